@@ -0,0 +1,75 @@
+// count heap allocations per token while decoding the same input
+// several times with one Selector, and fail if there are any once the
+// pools and caches are warm
+// usage: bench-allocs BINFILE INPUT [PASSES]
+#include "selector.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+static std::atomic<uint64_t> heap_allocations{0};
+
+void* operator new(std::size_t n)
+{
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(n ? n : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  free(p);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " BINFILE INPUT [PASSES]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  size_t passes = (argc > 3 ? strtoul(argv[3], nullptr, 10) : 4);
+  if (passes < 2) passes = 2;
+
+  Selector sel;
+  // big enough for every distinct reading, so warm passes never evict
+  sel.set_cache_size(1 << 20);
+  FILE* bin = fopen(argv[1], "rb");
+  if (bin == nullptr) {
+    std::cerr << "Unable to open " << argv[1] << std::endl;
+    return EXIT_FAILURE;
+  }
+  sel.load(bin);
+  fclose(bin);
+  StreamWriter out;
+  out.open_or_exit("/dev/null");
+
+  // the first pass fills the LU pool, the scratch vectors and the
+  // match cache, after which decoding should not allocate at all
+  bool ok = true;
+  printf("%5s %12s %12s\n", "pass", "allocations", "per token");
+  for (size_t p = 1; p <= passes; p++) {
+    StreamReader in;
+    in.open_or_exit(argv[2]);
+    uint64_t tokens = sel.get_token_count();
+    uint64_t before = heap_allocations;
+    sel.process(in, out);
+    uint64_t allocs = heap_allocations - before;
+    tokens = sel.get_token_count() - tokens;
+    double per_token = (tokens ? (double)allocs / (double)tokens : 0.0);
+    printf("%5zu %12llu %12.4f\n", p, (unsigned long long)allocs, per_token);
+    if (p > 1 && per_token > 0.001) ok = false;
+  }
+  if (!ok) {
+    std::cerr << "the decoder still allocates once warm" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
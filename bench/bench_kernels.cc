@@ -0,0 +1,61 @@
+// compare the dot/axpy kernels used by EmbeddingTrainer::train_pair
+// at typical embedding dimensions
+#include "vector_ops.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+int main(int argc, char** argv)
+{
+  size_t rows = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 4096);
+  size_t pairs = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 2000000);
+  size_t dims[] = {50, 100, 128, 200, 300};
+
+  auto kernels = available_vector_kernels();
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<float> val(-0.5f, 0.5f);
+  std::uniform_int_distribution<size_t> row(0, rows - 1);
+
+  printf("%-10s %5s %12s %12s %8s\n", "kernels", "dim", "ns/pair", "checksum", "speedup");
+  for (size_t dim : dims) {
+    std::vector<size_t> in(pairs);
+    std::vector<size_t> out(pairs);
+    for (size_t i = 0; i < pairs; i++) {
+      in[i] = row(rng);
+      out[i] = row(rng);
+    }
+    double base = 0.0;
+    for (auto& k : kernels) {
+      // the same starting values for every set of kernels
+      std::mt19937_64 init(dim);
+      FloatMatrix hidden, negative, errors;
+      hidden.resize(rows, dim);
+      negative.resize(rows, dim);
+      errors.resize(1, dim);
+      for (size_t r = 0; r < rows; r++) {
+        for (size_t j = 0; j < dim; j++) {
+          hidden.row(r)[j] = val(init) / (float)dim;
+          negative.row(r)[j] = val(init) / (float)dim;
+        }
+      }
+      auto start = std::chrono::steady_clock::now();
+      double check = 0.0;
+      for (size_t i = 0; i < pairs; i++) {
+        // train_pair() without the sigmoid table
+        const float* h = hidden.row(in[i]);
+        float* n = negative.row(out[i]);
+        float d = k.dot(h, n, dim);
+        float err = (0.5f - d) * 0.005f;
+        k.axpy(err, n, errors.row(0), dim);
+        k.axpy(err, h, n, dim);
+        check += d;
+      }
+      double ns = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count() / (double)pairs;
+      if (base == 0.0) base = ns;
+      printf("%-10s %5zu %12.2f %12.4f %7.2fx\n", k.name, dim, ns, check, base / ns);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+// compare the transducer pattern matcher against the determinized table
+// on a generated pattern set
+#include "pattern_matcher.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+int main(int argc, char** argv)
+{
+  size_t n_patterns = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 5000);
+  size_t n_readings = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000);
+  size_t max_states = (argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000000);
+
+  std::mt19937_64 rng(42);
+  std::vector<UString> lemmas;
+  for (size_t i = 0; i < 500; i++) {
+    UString l;
+    for (size_t j = 0; j < 3 + rng() % 5; j++) l += (UChar)('a' + rng() % 26);
+    lemmas.push_back(l);
+  }
+  std::vector<UString> tags;
+  for (size_t i = 0; i < 40; i++) {
+    UString t = "<t"_u;
+    t += (UChar)('a' + i % 26);
+    t += (UChar)('a' + i / 26);
+    t += '>';
+    tags.push_back(t);
+  }
+
+  PatternMatcher nfa, dfa;
+  for (auto& t : tags) {
+    nfa.get_alpha().includeSymbol(t);
+    dfa.get_alpha().includeSymbol(t);
+  }
+  for (size_t i = 1; i <= n_patterns; i++) {
+    UString pat;
+    switch (rng() % 3) {
+    case 0: pat += "sl/"_u; break;
+    case 1: pat += "tl/"_u; break;
+    }
+    if (rng() % 3 == 0) pat += lemmas[rng() % lemmas.size()];
+    else pat += '*';
+    for (size_t j = 0; j < 1 + rng() % 3; j++) pat += tags[rng() % tags.size()];
+    if (rng() % 2) pat += "<*>"_u;
+    nfa.add_pattern(i, pat);
+    dfa.add_pattern(i, pat);
+  }
+  nfa.build_trans();
+  dfa.build_trans();
+  nfa.set_cache_size(0);
+  dfa.set_cache_size(0);
+
+  using clock = std::chrono::steady_clock;
+  auto t0 = clock::now();
+  bool ok = dfa.determinize(max_states);
+  auto t1 = clock::now();
+  if (!ok) {
+    std::cerr << "more than " << max_states << " states, not determinized" << std::endl;
+  }
+
+  std::vector<Reading> readings(n_readings);
+  for (auto& r : readings) {
+    for (auto& c : lemmas[rng() % lemmas.size()]) {
+      r.get_symbols().push_back(static_cast<int32_t>(c));
+    }
+    for (size_t j = 0; j < 2 + rng() % 3; j++) {
+      r.get_symbols().push_back(nfa.get_alpha()(tags[rng() % tags.size()]));
+    }
+  }
+
+  size_t count_nfa = 0, count_dfa = 0;
+  bool same = true;
+  auto t2 = clock::now();
+  for (size_t i = 0; i < readings.size(); i++) {
+    sorted_vector<uint64_t> f;
+    nfa.get_features(&readings[i], i % 2, f);
+    count_nfa += f.size();
+  }
+  auto t3 = clock::now();
+  for (size_t i = 0; i < readings.size(); i++) {
+    sorted_vector<uint64_t> f;
+    dfa.get_features(&readings[i], i % 2, f);
+    count_dfa += f.size();
+  }
+  auto t4 = clock::now();
+  for (size_t i = 0; i < readings.size() && i < 10000; i++) {
+    sorted_vector<uint64_t> a, b;
+    nfa.get_features(&readings[i], i % 2, a);
+    dfa.get_features(&readings[i], i % 2, b);
+    if (!(a == b)) same = false;
+  }
+
+  auto ms = [](clock::time_point a, clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+  };
+  std::cout << "patterns: " << n_patterns << ", readings: " << n_readings << std::endl;
+  std::cout << "determinize: " << ms(t0, t1) << " ms" << std::endl;
+  std::cout << "transducer: " << ms(t2, t3) << " ms (" << count_nfa << " features)" << std::endl;
+  std::cout << "table:      " << ms(t3, t4) << " ms (" << count_dfa << " features)" << std::endl;
+  std::cout << "speedup: " << (ms(t2, t3) / ms(t3, t4)) << "x" << std::endl;
+  std::cout << "same features: " << (same ? "yes" : "NO") << std::endl;
+  return (same ? 0 : 1);
+}
@@ -0,0 +1,60 @@
+// check that the split-up hypothesis scores give byte-identical output
+// to scoring each merged window directly, and compare their speed
+// usage: bench-scorer BINFILE INPUT (e.g. the files run_bench.py writes)
+#include "selector.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+static std::string decode(const char* binfile, const char* input,
+                          bool reference, double& seconds)
+{
+  Selector sel;
+  sel.set_reference_scoring(reference);
+  FILE* bin = fopen(binfile, "rb");
+  if (bin == nullptr) {
+    std::cerr << "Unable to open " << binfile << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  sel.load(bin);
+  fclose(bin);
+  StreamReader in;
+  in.open_or_exit(input);
+  FILE* tmp = tmpfile();
+  StreamWriter out;
+  out.wrap(fileno(tmp));
+  auto start = std::chrono::steady_clock::now();
+  sel.process(in, out);
+  seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  std::string ret;
+  rewind(tmp);
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0) ret.append(buf, n);
+  fclose(tmp);
+  return ret;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " BINFILE INPUT" << std::endl;
+    return EXIT_FAILURE;
+  }
+  double ref_secs = 0.0, split_secs = 0.0;
+  std::string ref = decode(argv[1], argv[2], true, ref_secs);
+  std::string split = decode(argv[1], argv[2], false, split_secs);
+  printf("%-10s %10.3f s\n", "reference", ref_secs);
+  printf("%-10s %10.3f s  %.2fx\n", "split", split_secs, ref_secs / split_secs);
+  if (ref != split) {
+    size_t i = 0;
+    while (i < ref.size() && i < split.size() && ref[i] == split[i]) i++;
+    std::cerr << "outputs differ at byte " << i << std::endl;
+    return EXIT_FAILURE;
+  }
+  printf("outputs identical (%zu bytes)\n", ref.size());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+// compare weight lookup in a nested std::map (the old FeatureSet layout)
+// against WeightTable, using windows shaped like the ones the selector scores
+#include "weight_table.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+
+typedef std::map<FeatLoc, std::map<FeatLoc, double>> NestedMap;
+
+double score_map(NestedMap& m, const std::vector<FeatLoc>& vec)
+{
+  double ret = 0.0;
+  for (size_t i = 0; i < vec.size(); i++) {
+    auto loc = m.find(vec[i]);
+    if (loc == m.end()) continue;
+    auto dct = loc->second;
+    for (size_t j = i+1; j < vec.size(); j++) {
+      auto loc2 = dct.find(vec[j]);
+      if (loc2 == dct.end()) continue;
+      ret += loc2->second;
+    }
+  }
+  return ret;
+}
+
+double score_table(WeightTable& t, const std::vector<FeatLoc>& vec)
+{
+  double ret = 0.0;
+  for (size_t i = 0; i < vec.size(); i++) {
+    if (!t.has_first(vec[i])) continue;
+    for (size_t j = i+1; j < vec.size(); j++) {
+      const double* w = t.find(vec[i], vec[j]);
+      if (w != nullptr) ret += *w;
+    }
+  }
+  return ret;
+}
+
+int main(int argc, char** argv)
+{
+  size_t pairs = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000);
+  size_t windows = (argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000);
+  size_t feats = (argc > 3 ? strtoul(argv[3], nullptr, 10) : 5000);
+  size_t window_size = 40;
+  int lookbehind = 2;
+  int lookahead = 2;
+
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<int> pos(-lookbehind, lookahead);
+  std::uniform_int_distribution<uint64_t> feat(0, feats);
+  auto random_loc = [&]() { return std::make_pair(pos(rng), feat(rng)); };
+
+  NestedMap m;
+  WeightTable t;
+  for (size_t i = 0; i < pairs; i++) {
+    FeatLoc a = random_loc();
+    FeatLoc b = random_loc();
+    if (b < a) std::swap(a, b);
+    if (a == b) continue;
+    double w = (double)(rng() % 2000) / 100.0 - 10.0;
+    m[a].insert(std::make_pair(b, w));
+    t.insert(a, b, w);
+  }
+
+  std::vector<std::vector<FeatLoc>> queries(windows);
+  for (auto& q : queries) {
+    FeatSet fs;
+    while (fs.size() < window_size) fs.insert(random_loc());
+    q = fs.get();
+  }
+
+  using clock = std::chrono::steady_clock;
+  double sum_map = 0.0, sum_table = 0.0;
+  auto t0 = clock::now();
+  for (auto& q : queries) sum_map += score_map(m, q);
+  auto t1 = clock::now();
+  for (auto& q : queries) sum_table += score_table(t, q);
+  auto t2 = clock::now();
+
+  double ms_map = std::chrono::duration<double, std::milli>(t1 - t0).count();
+  double ms_table = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  std::cout << "pairs: " << t.size() << ", windows: " << windows
+            << ", features per window: " << window_size << std::endl;
+  std::cout << "std::map:    " << ms_map << " ms (sum " << sum_map << ")" << std::endl;
+  std::cout << "WeightTable: " << ms_table << " ms (sum " << sum_table << ")" << std::endl;
+  std::cout << "speedup: " << (ms_map / ms_table) << "x" << std::endl;
+  return (sum_map == sum_table ? 0 : 1);
+}
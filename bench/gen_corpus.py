@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+# generate a synthetic Apertium stream corpus and matching weights
+#
+# writes to OUTDIR:
+#   raw.txt      ambiguous corpus, one sentence per line
+#   gold.txt     the same corpus with the correct reading of each LU
+#   weights.pwf  patterns and weights for apertium-compile-selector
+#                and apertium-train-selector
+
+import argparse
+import os
+import random
+
+TAGS = ['n', 'vblex', 'adj', 'adv', 'det', 'pr', 'prn', 'cnjcoo', 'num',
+        'sg', 'pl', 'm', 'f', 'nt', 'pres', 'past', 'inf', 'p1', 'p2', 'p3',
+        'def', 'ind', 'sp', 'pos', 'comp', 'sup', 'subj', 'obj', 'tn', 'ger']
+
+
+def add_args(parser):
+    parser.add_argument('--vocab', type=int, default=5000,
+                        help='number of distinct surface forms')
+    parser.add_argument('--tokens', type=int, default=100000,
+                        help='number of LUs in the corpus')
+    parser.add_argument('--ambiguity', type=float, default=0.3,
+                        help='fraction of surface forms with several readings')
+    parser.add_argument('--readings', type=int, default=3,
+                        help='readings per ambiguous LU')
+    parser.add_argument('--patterns', type=int, default=500,
+                        help='number of P lines')
+    parser.add_argument('--weights', type=int, default=20000,
+                        help='number of W lines')
+    parser.add_argument('-L', '--lookbehind', type=int, default=2)
+    parser.add_argument('-R', '--lookahead', type=int, default=1)
+    parser.add_argument('-B', '--beam', type=int, default=5)
+    parser.add_argument('--seed', type=int, default=1)
+
+
+def word(rng, lo, hi):
+    return ''.join(rng.choice('abcdefghijklmnopqrstuvwxyz')
+                   for _ in range(rng.randint(lo, hi)))
+
+
+def reading(rng):
+    tags = rng.sample(TAGS, rng.randint(1, 4))
+    return word(rng, 2, 8) + ''.join('<%s>' % t for t in tags)
+
+
+def generate(args, outdir):
+    rng = random.Random(args.seed)
+    os.makedirs(outdir, exist_ok=True)
+
+    forms = []
+    for _ in range(args.vocab):
+        surf = word(rng, 1, 10)
+        n = args.readings if rng.random() < args.ambiguity else 1
+        forms.append((surf, [reading(rng) for _ in range(n)]))
+
+    # Zipfian choice of words, like real text
+    cum = []
+    total = 0.0
+    for i in range(len(forms)):
+        total += 1.0 / (i + 1)
+        cum.append(total)
+
+    with open(os.path.join(outdir, 'raw.txt'), 'w') as raw, \
+         open(os.path.join(outdir, 'gold.txt'), 'w') as gold:
+        written = 0
+        while written < args.tokens:
+            length = min(rng.randint(5, 30), args.tokens - written)
+            raw_words = []
+            gold_words = []
+            for _ in range(length):
+                x = rng.random() * total
+                lo, hi = 0, len(cum) - 1
+                while lo < hi:
+                    mid = (lo + hi) // 2
+                    if cum[mid] < x:
+                        lo = mid + 1
+                    else:
+                        hi = mid
+                surf, rds = forms[lo]
+                raw_words.append('^%s/%s$' % (surf, '/'.join(rds)))
+                gold_words.append('^%s/%s$' % (surf, rng.choice(rds)))
+            raw.write(' '.join(raw_words) + '\n')
+            gold.write(' '.join(gold_words) + '\n')
+            written += length
+
+    # lemmas of the generated readings, in order of first use
+    lemmas = []
+    seen = set()
+    for _, rds in forms:
+        for rd in rds:
+            lemma = rd.split('<', 1)[0]
+            if lemma not in seen:
+                seen.add(lemma)
+                lemmas.append(lemma)
+
+    names = []
+    with open(os.path.join(outdir, 'weights.pwf'), 'w') as pwf:
+        pwf.write('B %d\nL %d\nR %d\n' % (args.beam, args.lookbehind,
+                                          args.lookahead))
+        for i in range(args.patterns):
+            name = 'F%d' % i
+            names.append(name)
+            tags = ''.join('<%s>' % t for t in rng.sample(TAGS, rng.randint(1, 2)))
+            side = rng.choice(['', 'sl/', 'tl/'])
+            lemma = '*'
+            if rng.random() < 0.2:
+                lemma = rng.choice(lemmas)
+            pwf.write('P %s %s%s%s<*>\n' % (name, side, lemma, tags))
+        for _ in range(args.weights):
+            a = (rng.randint(-args.lookbehind, args.lookahead), rng.choice(names))
+            if rng.random() < 0.1:
+                pwf.write('W %d:%s %f\n' % (a[0], a[1], rng.gauss(0, 1)))
+                continue
+            b = (rng.randint(-args.lookbehind, args.lookahead), rng.choice(names))
+            pwf.write('W %d:%s %d:%s %f\n' % (a[0], a[1], b[0], b[1],
+                                              rng.gauss(0, 1)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('outdir')
+    add_args(parser)
+    args = parser.parse_args()
+    generate(args, args.outdir)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# end-to-end throughput of the apertium-selector tools on a generated
+# corpus (see gen_corpus.py)
+# for each tool, reports wall time, tokens/sec and peak RSS on the full
+# corpus, and wall time on a one-sentence input as startup time,
+# and writes everything as JSON so runs can be compared across commits
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+import gen_corpus
+
+
+def run(cmd, stdin_path=None):
+    stdin = open(stdin_path, 'rb') if stdin_path else subprocess.DEVNULL
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdin=stdin, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE)
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    err = proc.stderr.read().decode('utf-8', 'replace')
+    proc.stderr.close()
+    if stdin_path:
+        stdin.close()
+    code = os.waitstatus_to_exitcode(status)
+    if code != 0:
+        sys.stderr.write('%s exited with %d\n%s' % (' '.join(cmd), code, err))
+    return {'seconds': elapsed, 'peak_rss_kb': usage.ru_maxrss,
+            'exit_code': code}
+
+
+def head(src, dst, lines):
+    with open(src) as f, open(dst, 'w') as g:
+        for _ in range(lines):
+            g.write(f.readline())
+
+
+def git_commit():
+    try:
+        here = os.path.dirname(os.path.abspath(__file__))
+        return subprocess.check_output(['git', '-C', here, 'rev-parse', 'HEAD'],
+                                       stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--bindir', default='../src',
+                        help='directory containing the built tools')
+    parser.add_argument('--workdir', default='bench-data',
+                        help='where to write the corpus and outputs')
+    parser.add_argument('-o', '--output', default='bench-results.json')
+    parser.add_argument('--skip', action='append', default=[],
+                        help='tool to leave out (may be repeated)')
+    gen_corpus.add_args(parser)
+    args = parser.parse_args()
+
+    work = args.workdir
+    gen_corpus.generate(args, work)
+    raw = os.path.join(work, 'raw.txt')
+    gold = os.path.join(work, 'gold.txt')
+    pwf = os.path.join(work, 'weights.pwf')
+    binfile = os.path.join(work, 'weights.bin')
+    small_raw = os.path.join(work, 'small-raw.txt')
+    small_gold = os.path.join(work, 'small-gold.txt')
+    head(raw, small_raw, 1)
+    head(gold, small_gold, 1)
+    small_pwf = os.path.join(work, 'small.pwf')
+    with open(small_pwf, 'w') as f:
+        f.write('B 1\nL 1\nR 1\nP A *<n><*>\nW -1:A 0:A 1.0\n')
+    out = os.path.join(work, 'out')
+
+    def tool(name):
+        return os.path.join(args.bindir, name)
+
+    # name => (full command, startup command, tokens processed)
+    tools = {
+        'apertium-compile-selector':
+        ([tool('apertium-compile-selector'), pwf, binfile],
+         [tool('apertium-compile-selector'), small_pwf, out], None),
+        'apertium-selector':
+        ([tool('apertium-selector'), binfile, raw, out],
+         [tool('apertium-selector'), binfile, small_raw, out], args.tokens),
+        'apertium-train-selector':
+        ([tool('apertium-train-selector'), raw, gold, pwf, out],
+         [tool('apertium-train-selector'), small_raw, small_gold, pwf, out],
+         args.tokens),
+        'apertium-train-embeddings':
+        ([tool('apertium-train-embeddings'), raw, out],
+         [tool('apertium-train-embeddings'), small_raw, out], args.tokens),
+    }
+
+    results = {}
+    for name in ['apertium-compile-selector', 'apertium-selector',
+                 'apertium-train-selector', 'apertium-train-embeddings']:
+        if name in args.skip:
+            continue
+        full, startup, tokens = tools[name]
+        res = run(full)
+        res['startup_seconds'] = run(startup)['seconds']
+        if tokens is not None:
+            res['tokens'] = tokens
+            res['tokens_per_sec'] = tokens / res['seconds']
+        results[name] = res
+        print('%-28s %8.3f s  %8d KB  startup %.3f s%s' % (
+            name, res['seconds'], res['peak_rss_kb'], res['startup_seconds'],
+            ('  %.0f tokens/s' % res['tokens_per_sec']) if tokens else ''))
+
+    params = {k: v for k, v in vars(args).items()
+              if k not in ('bindir', 'workdir', 'output', 'skip')}
+    with open(args.output, 'w') as f:
+        json.dump({'commit': git_commit(), 'time': time.time(),
+                   'params': params, 'results': results}, f, indent=2)
+        f.write('\n')
+
+
+if __name__ == '__main__':
+    main()
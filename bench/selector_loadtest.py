@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# load test for apertium-selector --socket
+# each client keeps one connection open and sends the input file as a
+# \0-terminated request, waiting for the \0-terminated response before
+# sending the next one
+
+import argparse
+import socket
+import threading
+import time
+
+
+def client(path, request, count, latencies, errors):
+    try:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(path)
+        for _ in range(count):
+            start = time.perf_counter()
+            sock.sendall(request)
+            while True:
+                data = sock.recv(65536)
+                if not data:
+                    raise ConnectionError('server closed the connection')
+                if b'\0' in data:
+                    break
+            latencies.append(time.perf_counter() - start)
+        sock.close()
+    except Exception as e:
+        errors.append(str(e))
+
+
+def percentile(values, p):
+    values = sorted(values)
+    if not values:
+        return 0.0
+    idx = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('socket', help='path of the apertium-selector socket')
+    parser.add_argument('input', help='Apertium stream to send as each request')
+    parser.add_argument('-c', '--clients', type=int, default=8,
+                        help='number of concurrent connections (default 8)')
+    parser.add_argument('-n', '--requests', type=int, default=100,
+                        help='requests per connection (default 100)')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        request = f.read().replace(b'\0', b'')
+    request += b'\0'
+
+    latencies = []
+    errors = []
+    threads = [threading.Thread(target=client,
+                                args=(args.socket, request, args.requests,
+                                      latencies, errors))
+               for _ in range(args.clients)]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    print('clients: %d, requests: %d, errors: %d' %
+          (args.clients, len(latencies), len(errors)))
+    print('requests/sec: %.1f' % (len(latencies) / elapsed))
+    print('latency p50: %.2f ms' % (percentile(latencies, 50) * 1000))
+    print('latency p99: %.2f ms' % (percentile(latencies, 99) * 1000))
+    for e in errors[:5]:
+        print('error: ' + e)
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    exit(main())
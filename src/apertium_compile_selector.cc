@@ -5,6 +5,7 @@
 int main(int argc, char** argv)
 {
   CLI cli("Compile apertium-selector weights");
+  cli.add_bool_arg('m', "mmap", "write a memory-mappable file (faster to load, larger on disk)");
   cli.add_bool_arg('h', "help", "print this help and exit");
   cli.add_file_arg("input", true);
   cli.add_file_arg("output", true);
@@ -19,7 +20,7 @@ int main(int argc, char** argv)
   FILE* output = openOutBinFile(cli.get_files()[1]);
 
   fs.read(input);
-  fs.compile(output);
+  fs.compile(output, cli.get_bools()["mmap"]);
 
   fclose(output);
   return 0;
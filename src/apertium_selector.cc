@@ -1,11 +1,23 @@
-#include "selector.h"
+#include "cli_args.h"
+#include "profile.h"
+#include "selector_server.h"
 #include <lttoolbox/cli.h>
 #include <lttoolbox/file_utils.h>
+#include <cstdlib>
+#include <iostream>
 
 int main(int argc, char** argv)
 {
   CLI cli("Disambiguate Apertium stream format");
   cli.add_bool_arg('z', "null-flush", "flush stream on reading \\0");
+  cli.add_str_arg('c', "cache-size", "number of distinct readings to cache pattern matches for (default 10000, 0 to disable)", "N");
+  cli.add_str_arg('d', "dfa-states", "match patterns with a deterministic table of at most N states (falls back to the transducer if larger)", "N");
+  cli.add_str_arg('u', "max-uncommitted", "commit the best path after N ambiguous words in a row (default 0, unlimited)", "N");
+  cli.add_str_arg('H', "max-hypotheses", "keep at most N hypotheses per word, even if the beam size is larger or unlimited (default 0, no limit)", "N");
+  cli.add_str_arg('t', "threads", "decode with N threads (default 1)", "N");
+  cli.add_str_arg('s', "socket", "load the model once and serve clients on a Unix domain socket at PATH (see apertium-selector-client)", "PATH");
+  cli.add_bool_arg('S', "stats", "print statistics to stderr on exit");
+  cli.add_bool_arg('P', "profile", "print time spent in each stage and related counters to stderr on exit");
   cli.add_bool_arg('h', "help", "print this help and exit");
   cli.add_file_arg("binfile");
   cli.add_file_arg("input", true);
@@ -13,21 +25,78 @@ int main(int argc, char** argv)
   cli.parse_args(argc, argv);
 
   Selector sel;
+  auto& strs = cli.get_strs();
+  if (strs.find("socket") != strs.end()) {
+    // the server decodes each client on its own thread
+    // and reports nothing when it stops
+    if (strs.find("threads") != strs.end()) {
+      std::cerr << "--threads cannot be used with --socket." << std::endl;
+      return EXIT_FAILURE;
+    }
+    for (auto opt : {"stats", "profile"}) {
+      if (cli.get_bools()[opt]) {
+        std::cerr << "--" << opt << " cannot be used with --socket." << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (strs.find("cache-size") != strs.end()) {
+    sel.set_cache_size(parse_uint_arg("cache-size", strs["cache-size"].back()));
+  }
+  if (strs.find("max-uncommitted") != strs.end()) {
+    sel.set_max_uncommitted(parse_uint_arg("max-uncommitted", strs["max-uncommitted"].back()));
+  }
+  if (strs.find("max-hypotheses") != strs.end()) {
+    sel.set_max_hypotheses(parse_uint_arg("max-hypotheses", strs["max-hypotheses"].back()));
+  }
 
   FILE* bin = openInBinFile(cli.get_files()[0]);
   sel.load(bin);
   fclose(bin);
+  if (strs.find("dfa-states") != strs.end()) {
+    if (!sel.determinize(parse_uint_arg("dfa-states", strs["dfa-states"].back()))) {
+      std::cerr << "Warning: patterns need more than " << strs["dfa-states"].back()
+                << " states to determinize, using transducer matcher." << std::endl;
+    }
+  }
 
   //sel.dump();
 
-  InputFile input;
+  if (strs.find("socket") != strs.end()) {
+    SelectorServer server(sel, strs["socket"].back());
+    try {
+      server.run();
+    } catch (std::exception& e) {
+      std::cerr << "apertium-selector: " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  StreamReader input;
   if (!cli.get_files()[1].empty()) {
     input.open_or_exit(cli.get_files()[1].c_str());
   }
-  UFILE* output = openOutTextFile(cli.get_files()[2]);
+  StreamWriter output;
+  output.open_or_exit(cli.get_files()[2].c_str());
+
+  if (cli.get_bools()["profile"] && !profile_enable()) {
+    std::cerr << "Warning: profiling was disabled at compile time." << std::endl;
+  }
 
-  sel.process(input, output);
+  size_t threads = 1;
+  if (strs.find("threads") != strs.end()) {
+    threads = parse_uint_arg("threads", strs["threads"].back());
+  }
+
+  sel.process(input, output, threads);
+  output.flush();
+  if (!output.good()) {
+    std::cerr << "apertium-selector: unable to write output" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (cli.get_bools()["stats"]) sel.print_stats(std::cerr);
+  if (cli.get_bools()["profile"]) profile_report(std::cerr);
 
-  u_fclose(output);
   return 0;
 }
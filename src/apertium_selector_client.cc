@@ -0,0 +1,103 @@
+#include <lttoolbox/cli.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+// send input to an apertium-selector --socket server and copy its
+// output back
+// sending happens in a separate thread so that neither side blocks
+// with a full socket buffer on large inputs
+
+static bool write_all(int fd, const char* buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  CLI cli("Disambiguate Apertium stream format using a running apertium-selector --socket");
+  cli.add_bool_arg('h', "help", "print this help and exit");
+  cli.add_file_arg("socket");
+  cli.add_file_arg("input", true);
+  cli.add_file_arg("output", true);
+  cli.parse_args(argc, argv);
+
+  auto& files = cli.get_files();
+  FILE* input = stdin;
+  if (!files[1].empty()) {
+    input = fopen(files[1].c_str(), "rb");
+    if (input == nullptr) {
+      std::cerr << "Error: unable to open " << files[1] << std::endl;
+      return 1;
+    }
+  }
+  FILE* output = stdout;
+  if (!files[2].empty()) {
+    output = fopen(files[2].c_str(), "wb");
+    if (output == nullptr) {
+      std::cerr << "Error: unable to open " << files[2] << std::endl;
+      return 1;
+    }
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (files[0].size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Error: socket path too long: " << files[0] << std::endl;
+    return 1;
+  }
+  strncpy(addr.sun_path, files[0].c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+    std::cerr << "Error: unable to connect to " << files[0] << ": "
+              << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  bool sent = true;
+  std::thread sender([&]() {
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), input)) > 0) {
+      if (!write_all(fd, buf, n)) {
+        sent = false;
+        break;
+      }
+    }
+    shutdown(fd, SHUT_WR);
+  });
+
+  char buf[65536];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    fwrite(buf, 1, (size_t)n, output);
+    // pass -z style flushes through to whoever is reading our output
+    if (memchr(buf, '\0', (size_t)n) != nullptr) fflush(output);
+  }
+  sender.join();
+  close(fd);
+  if (input != stdin) fclose(input);
+  if (output != stdout) fclose(output);
+  if (!sent) {
+    std::cerr << "Error: connection closed before all input was sent" << std::endl;
+    return 1;
+  }
+  return 0;
+}
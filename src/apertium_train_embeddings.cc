@@ -1,3 +1,4 @@
+#include "cli_args.h"
 #include "embedding_trainer.h"
 #include <lttoolbox/cli.h>
 #include <lttoolbox/file_utils.h>
@@ -5,23 +6,77 @@
 int main(int argc, char** argv)
 {
   CLI cli("Train apertium-selector word embeddings");
+  cli.add_str_arg('t', "threads", "train on N threads, updating the vectors without locking (default 1)", "N");
+  cli.add_str_arg('e', "epochs", "number of passes over the corpus (default 5)", "N");
+  cli.add_str_arg('w', "window", "context words on each side (default 5)", "N");
+  cli.add_str_arg('d', "dimension", "size of the vectors (default 100)", "N");
+  cli.add_str_arg('n', "negative", "negative samples per context feature (default 0)", "N");
+  cli.add_str_arg('m', "min-count", "features seen fewer than N times become UNK (default 5)", "N");
+  cli.add_str_arg('s', "sample", "randomly skip occurrences of features more frequent than this fraction of tokens, e.g. 1e-4 (default 0, off)", "T");
+  cli.add_str_arg('a', "alpha", "starting learning rate, decreasing linearly to 0.0001 of it (default 0.005)", "A");
+  cli.add_str_arg('f', "corpus-file", "keep the encoded corpus in FILE, mapped into memory, instead of on the heap", "FILE");
+  cli.add_bool_arg('b', "binary", "write binary vectors (see embedding_file.h) rather than text");
+  cli.add_bool_arg('H', "half", "with --binary, store vectors as float16");
   cli.add_bool_arg('h', "help", "print this help and exit");
   cli.add_file_arg("raw_corpus", true);
   cli.add_file_arg("output_weights", true);
   cli.parse_args(argc, argv);
 
   EmbeddingTrainer et;
+  auto& strs = cli.get_strs();
+  if (strs.find("threads") != strs.end()) {
+    et.set_threads(parse_uint_arg("threads", strs["threads"].back()));
+  }
+  if (strs.find("epochs") != strs.end()) {
+    et.set_epochs(parse_uint_arg("epochs", strs["epochs"].back()));
+  }
+  if (strs.find("window") != strs.end()) {
+    et.set_window(parse_uint_arg("window", strs["window"].back()));
+  }
+  if (strs.find("dimension") != strs.end()) {
+    et.set_dimension(parse_uint_arg("dimension", strs["dimension"].back()));
+  }
+  if (strs.find("negative") != strs.end()) {
+    et.set_negative_samples(parse_uint_arg("negative", strs["negative"].back()));
+  }
+  if (strs.find("min-count") != strs.end()) {
+    et.set_min_count(parse_uint_arg("min-count", strs["min-count"].back()));
+  }
+  if (strs.find("sample") != strs.end()) {
+    et.set_sample(parse_double_arg("sample", strs["sample"].back(), 0.0));
+  }
+  if (strs.find("alpha") != strs.end()) {
+    et.set_alpha(parse_double_arg("alpha", strs["alpha"].back(), 0.0));
+  }
+  if (strs.find("corpus-file") != strs.end()) {
+    et.set_corpus_file(strs["corpus-file"].back());
+  }
+  bool binary = cli.get_bools()["binary"];
+  if (cli.get_bools()["half"] && !binary) {
+    std::cerr << "--half can only be used with --binary." << std::endl;
+    return EXIT_FAILURE;
+  }
 
-  InputFile input;
+  StreamReader input;
   if (!cli.get_files()[0].empty()) {
     input.open_or_exit(cli.get_files()[0].c_str());
   }
-  UFILE* output = openOutTextFile(cli.get_files()[1]);
+  FILE* bin_output = nullptr;
+  UFILE* output = nullptr;
+  if (binary) {
+    bin_output = openOutBinFile(cli.get_files()[1]);
+  } else {
+    output = openOutTextFile(cli.get_files()[1]);
+  }
 
   et.read_corpus(input);
   et.train();
-  et.write(output);
-
-  u_fclose(output);
+  if (binary) {
+    et.write_binary(bin_output, cli.get_bools()["half"]);
+    fclose(bin_output);
+  } else {
+    et.write(output);
+    u_fclose(output);
+  }
   return 0;
 }
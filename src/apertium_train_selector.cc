@@ -1,10 +1,28 @@
+#include "cli_args.h"
 #include "train.h"
 #include <lttoolbox/cli.h>
 #include <lttoolbox/file_utils.h>
+#include <iostream>
 
 int main(int argc, char** argv)
 {
   CLI cli("Train apertium-selector weights");
+  cli.add_str_arg('c', "cache-size", "number of distinct readings to cache pattern matches for (default 10000, 0 to disable)", "N");
+  cli.add_str_arg('d', "dfa-states", "match patterns with a deterministic table of at most N states (falls back to the transducer if larger)", "N");
+  cli.add_str_arg('t', "threads", "train on N threads with iterative parameter mixing (default 1)", "N");
+  cli.add_bool_arg('w', "hogwild", "with --threads, share one set of weights between threads without locking (faster, but not deterministic)");
+  cli.add_str_arg('s', "seed", "with --threads, shuffle sentences between threads with seed N (default 0, no shuffling)", "N");
+  cli.add_str_arg('b', "buffer-size", "keep training instances in a spill file instead of memory, reading N MiB of them at a time (default 64 with --spill-file)", "N");
+  cli.add_str_arg('f', "spill-file", "spill training instances to FILE (default: a temporary file, with --buffer-size)", "FILE");
+  cli.add_str_arg('i', "iterations", "number of training iterations (default 5)", "N");
+  cli.add_str_arg('p', "patience", "with a held-out set, stop after N iterations without improvement (default 0, never) and keep the best weights", "N");
+  cli.add_str_arg('k', "checkpoint", "write the training state to FILE after each iteration, and resume from it if it exists (in greedy mode, the instances are kept in FILE.spill or --spill-file so the corpus is only read to check it); needs the corpus as files, not stdin", "FILE");
+  cli.add_str_arg('m', "update", "train on whole sentences with beam search, updating early (early) or at the maximum violation (max-violation) rather than per word (greedy, the default)", "MODE");
+  cli.add_str_arg('B', "train-beam", "beam size for --update early or max-violation (default: the model's)", "N");
+  cli.add_str_arg('r', "heldout-raw", "raw held-out corpus, to report accuracy against --heldout-gold", "FILE");
+  cli.add_str_arg('g', "heldout-gold", "gold held-out corpus", "FILE");
+  cli.add_str_arg('C', "beam-curve", "comma-separated beam sizes to report held-out accuracy for after training (default 1,2,4,8,16)", "LIST");
+  cli.add_bool_arg('S', "stats", "print statistics to stderr on exit");
   cli.add_bool_arg('h', "help", "print this help and exit");
   cli.add_file_arg("raw_corpus", false);
   cli.add_file_arg("gold_corpus", false);
@@ -13,8 +31,95 @@ int main(int argc, char** argv)
   cli.parse_args(argc, argv);
 
   SelectorTrainer st;
+  auto& strs = cli.get_strs();
+  if (strs.find("cache-size") != strs.end()) {
+    st.set_cache_size(parse_uint_arg("cache-size", strs["cache-size"].back()));
+  }
+  if (strs.find("threads") != strs.end()) {
+    st.set_threads(parse_uint_arg("threads", strs["threads"].back()));
+  }
+  if (strs.find("seed") != strs.end()) {
+    st.set_seed(parse_uint_arg("seed", strs["seed"].back()));
+  }
+  st.set_hogwild(cli.get_bools()["hogwild"]);
+  if (strs.find("buffer-size") != strs.end()) {
+    size_t mb = parse_uint_arg("buffer-size", strs["buffer-size"].back());
+    st.set_buffer_size((mb ? mb : 1) << 20);
+  }
+  if (strs.find("spill-file") != strs.end()) {
+    st.set_spill_file(strs["spill-file"].back());
+  }
 
-  InputFile raw, gold, input;
+  if (strs.find("update") != strs.end()) {
+    auto& mode = strs["update"].back();
+    if (mode == "greedy") {
+      st.set_update_mode(SelectorTrainer::UPDATE_GREEDY);
+    } else if (mode == "early") {
+      st.set_update_mode(SelectorTrainer::UPDATE_EARLY);
+    } else if (mode == "max-violation") {
+      st.set_update_mode(SelectorTrainer::UPDATE_MAX_VIOLATION);
+    } else {
+      std::cerr << "Unknown update mode " << mode << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (strs.find("update") != strs.end() && strs["update"].back() != "greedy") {
+    // structured training is single-threaded and keeps sentences in memory
+    for (auto opt : {"threads", "buffer-size", "spill-file"}) {
+      if (strs.find(opt) != strs.end()) {
+        std::cerr << "--" << opt << " cannot be used with --update "
+                  << strs["update"].back() << "." << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    if (cli.get_bools()["hogwild"]) {
+      std::cerr << "--hogwild cannot be used with --update "
+                << strs["update"].back() << "." << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (strs.find("train-beam") != strs.end()) {
+    st.set_train_beam(parse_uint_arg("train-beam", strs["train-beam"].back()));
+  }
+  size_t iterations = 5;
+  if (strs.find("iterations") != strs.end()) {
+    iterations = parse_uint_arg("iterations", strs["iterations"].back());
+  }
+  if (strs.find("patience") != strs.end()) {
+    st.set_patience(parse_uint_arg("patience", strs["patience"].back()));
+  }
+  if (strs.find("checkpoint") != strs.end()) {
+    // resuming has to read the same corpus again
+    if (cli.get_files()[0].empty() || cli.get_files()[1].empty()) {
+      std::cerr << "--checkpoint needs the raw and gold corpora as files, not stdin." << std::endl;
+      return EXIT_FAILURE;
+    }
+    st.set_checkpoint(strs["checkpoint"].back());
+  }
+  bool heldout = (strs.find("heldout-raw") != strs.end());
+  if (heldout != (strs.find("heldout-gold") != strs.end())) {
+    std::cerr << "--heldout-raw and --heldout-gold must be used together." << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (strs.find("patience") != strs.end() && !heldout) {
+    std::cerr << "--patience cannot be used without --heldout-raw and --heldout-gold." << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<size_t> beams = {1, 2, 4, 8, 16};
+  if (strs.find("beam-curve") != strs.end()) {
+    beams.clear();
+    std::string list = strs["beam-curve"].back();
+    size_t start = 0;
+    while (start < list.size()) {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+      if (end > start) beams.push_back(parse_uint_arg("beam-curve", list.substr(start, end - start)));
+      start = end + 1;
+    }
+  }
+
+  StreamReader raw, gold;
+  InputFile input;
   if (!cli.get_files()[0].empty()) {
     raw.open_or_exit(cli.get_files()[0].c_str());
   }
@@ -27,8 +132,22 @@ int main(int argc, char** argv)
   UFILE* output = openOutTextFile(cli.get_files()[3]);
 
   st.read(input);
-  st.train(raw, gold, 5);
+  if (strs.find("dfa-states") != strs.end()) {
+    if (!st.determinize(parse_uint_arg("dfa-states", strs["dfa-states"].back()))) {
+      std::cerr << "Warning: patterns need more than " << strs["dfa-states"].back()
+                << " states to determinize, using transducer matcher." << std::endl;
+    }
+  }
+  if (heldout) {
+    StreamReader hraw, hgold;
+    hraw.open_or_exit(strs["heldout-raw"].back().c_str());
+    hgold.open_or_exit(strs["heldout-gold"].back().c_str());
+    st.load_heldout(hraw, hgold);
+  }
+  st.train(raw, gold, iterations);
   st.write(output);
+  if (heldout) st.print_beam_curve(std::cerr, beams);
+  if (cli.get_bools()["stats"]) st.print_stats(std::cerr);
 
   u_fclose(output);
   return 0;
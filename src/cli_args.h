@@ -0,0 +1,46 @@
+#ifndef __SELECTOR_CLI_ARGS_H__
+#define __SELECTOR_CLI_ARGS_H__
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// values of numeric command-line options
+// anything that isn't entirely a number in range (for parse_double_arg,
+// at least min) prints "invalid value for --name" and exits
+
+inline uint64_t parse_uint_arg(const std::string& name, const std::string& val)
+{
+  char* end = nullptr;
+  errno = 0;
+  unsigned long long n = 0;
+  // strtoull would accept a sign, and negate
+  if (!val.empty() && val[0] >= '0' && val[0] <= '9') {
+    n = strtoull(val.c_str(), &end, 10);
+  }
+  if (end == nullptr || *end != '\0' || errno == ERANGE) {
+    std::cerr << "invalid value for --" << name << ": " << val << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return (uint64_t)n;
+}
+
+inline double parse_double_arg(const std::string& name, const std::string& val,
+                               double min = -HUGE_VAL)
+{
+  char* end = nullptr;
+  errno = 0;
+  double d = 0.0;
+  if (!val.empty()) d = strtod(val.c_str(), &end);
+  if (end == nullptr || end == val.c_str() || *end != '\0' ||
+      errno == ERANGE || !std::isfinite(d) || d < min) {
+    std::cerr << "invalid value for --" << name << ": " << val << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return d;
+}
+
+#endif
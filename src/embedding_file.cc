@@ -0,0 +1,221 @@
+#include "embedding_file.h"
+#include "file_header.h"
+#include <lttoolbox/endian_util.h>
+#include <unicode/ustring.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+uint16_t float_to_half(float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, 4);
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t exp = (x >> 23) & 0xFF;
+  uint32_t mant = x & 0x7FFFFF;
+  if (exp == 0xFF) {
+    return (uint16_t)(sign | 0x7C00 | (mant ? 0x200 : 0));
+  }
+  int e = (int)exp - 127 + 15;
+  if (e >= 0x1F) return (uint16_t)(sign | 0x7C00);
+  if (e <= 0) {
+    // subnormal, rounded to nearest even
+    if (e < -10) return (uint16_t)sign;
+    mant |= 0x800000;
+    uint32_t shift = (uint32_t)(14 - e);
+    uint32_t h = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1))) h++;
+    return (uint16_t)(sign | h);
+  }
+  uint32_t h = ((uint32_t)e << 10) | (mant >> 13);
+  uint32_t rem = mant & 0x1FFF;
+  // a carry into the exponent is still correct
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+  return (uint16_t)(sign | h);
+}
+
+float half_to_float(uint16_t h)
+{
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1F;
+  uint32_t mant = h & 0x3FF;
+  uint32_t x;
+  if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {
+      uint32_t e = 0;
+      while (!(mant & 0x400)) {
+        mant <<= 1;
+        e++;
+      }
+      x = sign | ((113 - e) << 23) | ((mant & 0x3FF) << 13);
+    }
+  } else if (exp == 0x1F) {
+    x = sign | 0x7F800000 | (mant << 13);
+  } else {
+    x = sign | ((exp + 112) << 23) | (mant << 13);
+  }
+  float f;
+  memcpy(&f, &x, 4);
+  return f;
+}
+
+void write_embedding_file(FILE* output, const std::vector<UString>& patterns,
+                          const FloatMatrix& vectors, bool half)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  throw std::runtime_error("Binary embeddings can only be written on little-endian machines - use the text format!");
+#endif
+  fwrite_unlocked(HEADER_APSE, 1, 4, output);
+  write_le<uint64_t>(output, (half ? (uint64_t)APSE_FLOAT16 : 0));
+  write_le<uint64_t>(output, vectors.rows());
+  write_le<uint64_t>(output, vectors.cols());
+  // pad rows to 64 bytes
+  size_t per_line = (half ? 32 : 16);
+  size_t stride = (vectors.cols() + per_line - 1) / per_line * per_line;
+  write_le<uint64_t>(output, stride);
+  uint64_t offset = 4 + 4*8;
+  std::string utf8;
+  for (size_t i = 0; i < vectors.rows(); i++) {
+    utf8.clear();
+    if (i > 0 && i < patterns.size() && !patterns[i].empty()) {
+      int32_t len = 0;
+      UErrorCode err = U_ZERO_ERROR;
+      u_strToUTF8(nullptr, 0, &len, patterns[i].data(),
+                  (int32_t)patterns[i].size(), &err);
+      utf8.resize((size_t)len);
+      err = U_ZERO_ERROR;
+      u_strToUTF8(&utf8[0], len, &len, patterns[i].data(),
+                  (int32_t)patterns[i].size(), &err);
+    }
+    write_le<uint64_t>(output, utf8.size());
+    fwrite_unlocked(utf8.data(), 1, utf8.size(), output);
+    offset += 8 + utf8.size();
+  }
+  // pad so the matrix can be used in place
+  for (; offset % 64; offset++) fputc_unlocked(0, output);
+  std::vector<uint16_t> buf(stride, 0);
+  std::vector<float> pad(stride - vectors.cols(), 0.0f);
+  for (size_t i = 0; i < vectors.rows(); i++) {
+    const float* row = vectors.row(i);
+    if (half) {
+      for (size_t j = 0; j < vectors.cols(); j++) buf[j] = float_to_half(row[j]);
+      fwrite_unlocked(buf.data(), 2, buf.size(), output);
+    } else {
+      fwrite_unlocked(row, 4, vectors.cols(), output);
+      fwrite_unlocked(pad.data(), 4, pad.size(), output);
+    }
+  }
+  if (ferror(output)) {
+    throw std::runtime_error("Unable to write embeddings file.");
+  }
+}
+
+void EmbeddingFile::clear()
+{
+  if (mapped != nullptr) {
+    munmap(mapped, mapped_len);
+    mapped = nullptr;
+    mapped_len = 0;
+  }
+  vocab_size = 0;
+  dim = 0;
+  stride = 0;
+  half = false;
+  patterns.clear();
+  matrix = nullptr;
+}
+
+void EmbeddingFile::load(FILE* input)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  throw std::runtime_error("Binary embeddings can only be loaded on little-endian machines - use the text format!");
+#endif
+  clear();
+  struct stat st;
+  if (fstat(fileno(input), &st) != 0) {
+    throw std::runtime_error("Unable to determine size of embeddings file.");
+  }
+  size_t len = (size_t)st.st_size;
+  if (len < 4 + 4*8) {
+    throw std::runtime_error("Embeddings file is truncated.");
+  }
+  mapped = mmap(nullptr, len, PROT_READ, MAP_SHARED, fileno(input), 0);
+  if (mapped == MAP_FAILED) {
+    mapped = nullptr;
+    throw std::runtime_error("Unable to mmap embeddings file.");
+  }
+  mapped_len = len;
+  const char* data = static_cast<const char*>(mapped);
+  if (strncmp(data, HEADER_APSE, 4) != 0) {
+    clear();
+    throw std::runtime_error("Embeddings file is missing header!");
+  }
+  uint64_t head[4];
+  memcpy(head, data + 4, sizeof(head));
+  if (head[0] >= APSE_UNKNOWN) {
+    clear();
+    throw std::runtime_error("This embeddings file has features that are unknown to this version of apertium-selector - upgrade!");
+  }
+  half = (head[0] & APSE_FLOAT16);
+  vocab_size = head[1];
+  dim = head[2];
+  stride = head[3];
+  size_t width = (half ? 2 : 4);
+  if (stride < dim || stride % (64 / width) != 0) {
+    clear();
+    throw std::runtime_error("Embeddings file has an invalid row stride.");
+  }
+  size_t offset = 4 + sizeof(head);
+  // every pattern takes at least 8 bytes
+  if (vocab_size > (len - offset) / 8) {
+    clear();
+    throw std::runtime_error("Embeddings file is truncated.");
+  }
+  patterns.reserve(vocab_size);
+  for (uint64_t i = 0; i < vocab_size; i++) {
+    uint64_t n;
+    if (offset + 8 > len) break;
+    memcpy(&n, data + offset, 8);
+    offset += 8;
+    if (n > len - offset) break;
+    patterns.push_back(std::make_pair(offset, (size_t)n));
+    offset += n;
+  }
+  offset = (offset + 63) & ~(size_t)63;
+  if (patterns.size() != vocab_size || offset > len ||
+      (stride && vocab_size > (len - offset) / width / stride)) {
+    clear();
+    throw std::runtime_error("Embeddings file is truncated.");
+  }
+  matrix = data + offset;
+}
+
+UString EmbeddingFile::get_pattern(size_t i) const
+{
+  auto& p = patterns[i];
+  if (p.second == 0) return UString();
+  std::string utf8(static_cast<const char*>(mapped) + p.first, p.second);
+  return to_ustring(utf8.c_str());
+}
+
+const float* EmbeddingFile::row(size_t i) const
+{
+  if (half) return nullptr;
+  return reinterpret_cast<const float*>(matrix) + i * stride;
+}
+
+void EmbeddingFile::get_row(size_t i, float* out) const
+{
+  if (half) {
+    const uint16_t* h = reinterpret_cast<const uint16_t*>(matrix) + i * stride;
+    for (size_t j = 0; j < dim; j++) out[j] = half_to_float(h[j]);
+  } else {
+    memcpy(out, row(i), dim * sizeof(float));
+  }
+}
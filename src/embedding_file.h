@@ -0,0 +1,58 @@
+#ifndef __SELECTOR_EMBEDDING_FILE_H__
+#define __SELECTOR_EMBEDDING_FILE_H__
+
+#include "vector_ops.h"
+#include <lttoolbox/ustring.h>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Binary embeddings, all little-endian:
+//   HEADER_APSE, uint64 features (APSE_FEATURES),
+//   uint64 vocabulary size, uint64 dimension, uint64 row stride,
+//   for each feature: uint64 byte length, UTF-8 pattern (empty for UNK),
+//   zero padding to a 64-byte boundary,
+//   vocabulary size x row stride float32 (or float16) values,
+//   where each row is dimension values followed by zeros, so that
+//   every row starts on a 64-byte boundary
+
+uint16_t float_to_half(float f);
+float half_to_float(uint16_t h);
+
+// write row i of vectors as the vector for patterns[i]
+void write_embedding_file(FILE* output, const std::vector<UString>& patterns,
+                          const FloatMatrix& vectors, bool half = false);
+
+// a binary embeddings file, mapped into memory
+class EmbeddingFile {
+private:
+  void* mapped = nullptr;
+  size_t mapped_len = 0;
+  uint64_t vocab_size = 0;
+  uint64_t dim = 0;
+  uint64_t stride = 0;
+  bool half = false;
+  // (offset, length) of each pattern in mapped
+  std::vector<std::pair<size_t, size_t>> patterns;
+  const char* matrix = nullptr;
+  void clear();
+public:
+  EmbeddingFile() {}
+  ~EmbeddingFile() { clear(); }
+  EmbeddingFile(const EmbeddingFile&) = delete;
+  EmbeddingFile& operator=(const EmbeddingFile&) = delete;
+  // throws std::runtime_error if input isn't a complete embeddings file
+  void load(FILE* input);
+  size_t size() const { return vocab_size; }
+  size_t dimension() const { return dim; }
+  bool is_half() const { return half; }
+  // the pattern of feature i, empty for UNK (0)
+  UString get_pattern(size_t i) const;
+  // vector i in place, 64-byte aligned like a FloatMatrix row,
+  // or nullptr if the file is float16
+  const float* row(size_t i) const;
+  // copy vector i into out, converting from float16 if needed
+  void get_row(size_t i, float* out) const;
+};
+
+#endif
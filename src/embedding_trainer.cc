@@ -1,50 +1,97 @@
 #include "embedding_trainer.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
 
 EmbeddingTrainer::EmbeddingTrainer()
 {
   make_exp_table();
 }
 
-EmbeddingTrainer::~EmbeddingTrainer() {}
+EmbeddingTrainer::~EmbeddingTrainer()
+{
+  if (mapped != nullptr) munmap(mapped, mapped_len);
+}
 
 double EmbeddingTrainer::softmax(double f) {
-  if (f > MAX_EXP) return -1;
-  if (f < -MAX_EXP) return 0;
-  return _exp_table[(size_t)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+  double max_exp = (double)MAX_EXP;
+  if (f >= max_exp) return 1;
+  if (f <= -max_exp) return 0;
+  return _exp_table[(size_t)((f + max_exp) * ((double)EXP_TABLE_SIZE / max_exp / 2))];
 }
 
 void EmbeddingTrainer::make_exp_table() {
-  _exp_table.reserve(EXP_TABLE_SIZE);
+  _exp_table.resize(EXP_TABLE_SIZE);
   for (size_t i = 0; i < EXP_TABLE_SIZE; i++) {
     _exp_table[i] = exp((i / (double)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
     _exp_table[i] = _exp_table[i] / (_exp_table[i] + 1);
   }
 }
 
-void EmbeddingTrainer::init_unigram_table()
+void AliasTable::build(const std::vector<double>& weights)
 {
-  double denom = 0;
-  for (size_t i = 1; i < vocab.size(); i++) {
-    denom += pow(vocab[i], 0.75);
-  }
-  unigram_table.reserve(unigram_table_size);
-  uint64_t vocab_idx = 1; // skip UNK
-  // everything is UNK - something has gone VERY wrong
-  if (vocab.size() <= 1) return;
-  double frac_done = pow(vocab[vocab_idx], 0.75) / denom;
-  for (uint64_t uni_idx = 0; uni_idx < unigram_table_size; uni_idx++) {
-    unigram_table[uni_idx] = vocab_idx;
-    if (uni_idx / (double)unigram_table_size > frac_done) {
-      vocab_idx++;
-      if (vocab_idx >= vocab.size()) {
-        frac_done = 1.0;
-        vocab_idx = vocab.size()-1;
-      } else {
-        frac_done = pow(vocab[vocab_idx], 0.75) / denom;
-      }
+  size_t n = weights.size();
+  prob.assign(n, 1.0);
+  alias.resize(n);
+  for (size_t i = 0; i < n; i++) alias[i] = (uint32_t)i;
+  double total = 0.0;
+  for (auto& w : weights) total += w;
+  if (n == 0 || total <= 0.0) return;
+  // scale so the average is 1, then pair each index below 1
+  // with one above 1 that fills up the rest of its slot
+  std::vector<double> scaled(n);
+  std::vector<uint32_t> small;
+  std::vector<uint32_t> large;
+  for (size_t i = 0; i < n; i++) {
+    scaled[i] = weights[i] * (double)n / total;
+    if (scaled[i] < 1.0) small.push_back((uint32_t)i);
+    else large.push_back((uint32_t)i);
+  }
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back();
+    small.pop_back();
+    uint32_t l = large.back();
+    prob[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= (1.0 - scaled[s]);
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
     }
   }
+  // anything left over is 1 up to rounding
+  for (auto& i : small) prob[i] = 1.0;
+  for (auto& i : large) prob[i] = 1.0;
+}
+
+void EmbeddingTrainer::init_negative_table()
+{
+  std::vector<double> weights;
+  // skip UNK
+  for (size_t i = 1; i < vocab.size(); i++) {
+    weights.push_back(pow(vocab[i], 0.75));
+  }
+  negative_table.build(weights);
+}
+
+void EmbeddingTrainer::init_keep_prob()
+{
+  keep_prob.assign(vocab.size(), 1.0f);
+  if (sample <= 0.0) return;
+  double threshold = sample * (double)token_count;
+  for (size_t i = 0; i < vocab.size(); i++) {
+    if (vocab[i] == 0) continue;
+    double f = (double)vocab[i];
+    keep_prob[i] = (float)((sqrt(f / threshold) + 1) * threshold / f);
+  }
 }
 
 uint64_t EmbeddingTrainer::get_or_create_feat(const UString& key)
@@ -74,17 +121,15 @@ void EmbeddingTrainer::init_corpus()
   vocab.clear();
   vocab_pats.clear();
   vocab_pats_inv.clear();
-  sentences.clear();
-  sentences_raw.clear();
-
-  sentences.resize(1);
-  sentences_raw.resize(1);
+  corpus.clear();
+  sentence_starts.assign(1, 0);
+  token_count = 0;
   get_or_create_feat(""_u);
 }
 
 void EmbeddingTrainer::trim_vocab()
 {
-  std::map<uint64_t, uint64_t> feat_remap;
+  std::vector<uint32_t> feat_remap(vocab.size(), 0);
   sorted_vector<std::pair<uint64_t, uint64_t>, std::greater<std::pair<uint64_t, uint64_t>>> sort_counts;
   uint64_t unk_count = vocab[0];
   for (uint64_t i = 1; i < vocab.size(); i++) {
@@ -105,96 +150,264 @@ void EmbeddingTrainer::trim_vocab()
   for (auto& it : sort_counts) {
     uint64_t newfeat = get_or_create_feat(temp_pats[it.second]);
     vocab[newfeat] = it.first;
-    feat_remap[it.first] = newfeat;
+    feat_remap[it.second] = (uint32_t)newfeat;
   }
-  for (auto& sent : sentences) {
-    for (auto& wd : sent) {
-      WordFeats wfnew;
-      for (auto& it : wd) wfnew.insert(feat_remap[it]);
+  // rewritten in place, since words can only lose features
+  size_t out = 0;
+  WordFeats wfnew;
+  for (size_t s = 0; s + 1 < sentence_starts.size(); s++) {
+    size_t i = sentence_starts[s];
+    size_t end = sentence_starts[s+1];
+    sentence_starts[s] = out;
+    while (i < end) {
+      wfnew.clear();
+      do {
+        wfnew.insert(feat_remap[corpus[i] & ~CONTINUATION]);
+        i++;
+      } while (i < end && (corpus[i] & CONTINUATION));
       // only include UNK if all feats are UNK
       if (wfnew.size() > 1 && wfnew.count(0)) wfnew.erase(0);
-      wfnew.swap(wd);
+      bool first = true;
+      for (auto& f : wfnew) {
+        corpus[out++] = (uint32_t)f | (first ? 0 : CONTINUATION);
+        first = false;
+      }
     }
   }
+  sentence_starts.back() = out;
+  corpus.resize(out);
+  corpus.shrink_to_fit();
 }
 
-void EmbeddingTrainer::read_corpus(InputFile& input)
+void EmbeddingTrainer::spill_corpus()
+{
+  FILE* f = fopen(corpus_path.c_str(), "w+b");
+  if (f == nullptr ||
+      fwrite(corpus.data(), sizeof(uint32_t), corpus.size(), f) != corpus.size() ||
+      fflush(f) != 0) {
+    std::cerr << "ERROR: Unable to write " << corpus_path << ": "
+              << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  mapped_len = corpus.size() * sizeof(uint32_t);
+  if (mapped_len > 0) {
+    mapped = mmap(nullptr, mapped_len, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "ERROR: Unable to mmap " << corpus_path << ": "
+                << strerror(errno) << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    mapped = nullptr;
+  }
+  fclose(f);
+  std::vector<uint32_t>().swap(corpus);
+  tokens = static_cast<const uint32_t*>(mapped);
+}
+
+void EmbeddingTrainer::read_corpus(StreamReader& input)
 {
   init_corpus();
+  LU l;
   while (!input.eof()) {
-    LU* l = new LU();
-    l->read(input, alphabet);
-    if (l->isEOF()) break;
-    if (l->after_newline()) {
-      sentences_raw.resize(sentences_raw.size()+1);
-      sentences.resize(sentences.size()+1);
+    l.clear();
+    input.read_lu(&l, alphabet);
+    if (l.isEOF()) break;
+    if (l.after_newline()) {
+      sentence_starts.push_back(corpus.size());
     }
-    sentences_raw.back().push_back(l);
-    auto keys = get_keys(l);
-    sentences.back().push_back(keys);
-    for (auto& it : keys) vocab[it] += 1;
+    auto keys = get_keys(&l);
+    bool first = true;
+    for (auto& it : keys) {
+      if (it >= CONTINUATION) {
+        std::cerr << "ERROR: more than " << CONTINUATION
+                  << " features." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      vocab[it] += 1;
+      corpus.push_back((uint32_t)it | (first ? 0 : CONTINUATION));
+      first = false;
+    }
+    token_count++;
   }
+  sentence_starts.push_back(corpus.size());
   trim_vocab();
-  init_unigram_table();
+  init_negative_table();
+  init_keep_prob();
+  tokens = corpus.data();
+  if (!corpus_path.empty()) spill_corpus();
 }
 
-void EmbeddingTrainer::train_pair(uint64_t input, uint64_t output, bool neg)
+void EmbeddingTrainer::train_pair(EmbeddingThread& th, uint64_t input,
+                                  uint64_t output, bool neg)
 {
-  double val = 0.0;
-  for (size_t i = 0; i < dimension; i++) {
-    val += hidden_layer[(input * dimension) + i] * negative_layer[(output * dimension) + i];
-  }
+  const VectorKernels& k = vector_kernels();
+  const float* hidden = hidden_layer.row(input);
+  float* negative = negative_layer.row(output);
+  double val = k.dot(hidden, negative, dimension);
   double err = (neg ? 0.0 : 1.0);
-  err = (err - softmax(val)) * alpha;
-  for (size_t i = 0; i < dimension; i++) {
-    errors[i] += err * negative_layer[(output * dimension) + i];
-    negative_layer[(output * dimension) + i] += err * hidden_layer[(input * dimension)];
-  }
+  err = (err - softmax(val)) * th.alpha;
+  // errors first, since they use the old negative_layer
+  k.axpy((float)err, negative, th.errors.row(0), dimension);
+  k.axpy((float)err, hidden, negative, dimension);
 }
 
-void EmbeddingTrainer::train_word(size_t sent_idx, size_t word_idx)
+void EmbeddingTrainer::train_word(EmbeddingThread& th, const uint32_t* sent,
+                                  const std::vector<uint32_t>& word_starts,
+                                  size_t word_idx)
 {
+  size_t n_words = word_starts.size() - 1;
   size_t start = (word_idx > window ? word_idx - window : 0);
-  auto& sent = sentences[sent_idx];
   WordFeats ctx;
-  for (size_t i = start; i < sent.size() && i <= word_idx + window; i++) {
+  for (size_t i = start; i < n_words && i <= word_idx + window; i++) {
     if (i == word_idx) continue;
-    ctx.insert(sent[i].begin(), sent[i].end());
+    for (uint32_t k = word_starts[i]; k < word_starts[i+1]; k++) {
+      ctx.insert(sent[k] & ~CONTINUATION);
+    }
   }
-  for (auto& w : sent[word_idx]) {
-    errors.clear();
-    errors.resize(dimension, 0.0);
+  for (uint32_t k = word_starts[word_idx]; k < word_starts[word_idx+1]; k++) {
+    uint64_t w = sent[k] & ~CONTINUATION;
+    std::fill(th.errors.row(0), th.errors.row(0) + dimension, 0.0f);
     for (auto& c : ctx) {
-      train_pair(w, c, false);
-      for (size_t n = 0; n < negative_samples; n++) {
-        size_t idx = (random() >> 16) % unigram_table.size();
-        uint64_t negfeat = unigram_table[idx];
+      train_pair(th, w, c, false);
+      for (size_t n = 0; n < negative_samples && !negative_table.empty(); n++) {
+        uint64_t r = th.random() >> 16;
+        uint64_t negfeat = negative_table.draw(r, th.random() >> 16) + 1;
         if (ctx.count(negfeat)) continue;
-        train_pair(w, negfeat, true);
+        train_pair(th, w, negfeat, true);
       }
     }
-    for (size_t i = 0; i < dimension; i++) {
-      hidden_layer[(w * dimension) + i] += errors[i];
+    vector_kernels().axpy(1.0f, th.errors.row(0), hidden_layer.row(w), dimension);
+  }
+}
+
+void EmbeddingTrainer::train_range(EmbeddingThread& th, size_t first, size_t last)
+{
+  th.errors.resize(1, dimension);
+  th.alpha = alpha;
+  std::vector<uint32_t> kept;
+  std::vector<uint32_t> word_starts;
+  for (size_t iteration = 0; iteration < epochs; iteration++) {
+    for (size_t sent = first; sent < last; sent++) {
+      const uint32_t* begin = tokens + sentence_starts[sent];
+      uint32_t len = (uint32_t)(sentence_starts[sent+1] - sentence_starts[sent]);
+      size_t n_words = 0;
+      if (sample > 0.0) {
+        // the sentence without skipped occurrences
+        kept.clear();
+        bool first_feat = true;
+        for (uint32_t k = 0; k < len; k++) {
+          if (!(begin[k] & CONTINUATION)) {
+            n_words++;
+            first_feat = true;
+          }
+          uint32_t f = begin[k] & ~CONTINUATION;
+          if (keep_prob[f] < 1.0f && keep_prob[f] < th.frandom()) continue;
+          kept.push_back(f | (first_feat ? 0 : CONTINUATION));
+          first_feat = false;
+        }
+        begin = kept.data();
+        len = (uint32_t)kept.size();
+      }
+      word_starts.clear();
+      for (uint32_t k = 0; k < len; k++) {
+        if (!(begin[k] & CONTINUATION)) word_starts.push_back(k);
+      }
+      size_t n_kept = word_starts.size();
+      if (sample <= 0.0) n_words = n_kept;
+      word_starts.push_back(len);
+      for (size_t word = 0; word < n_kept; word++) {
+        train_word(th, begin, word_starts, word);
+      }
+      th.words.fetch_add(n_words, std::memory_order_relaxed);
+      // linear decay over all threads' progress, as in word2vec
+      uint64_t done = words_done.fetch_add(n_words, std::memory_order_relaxed) + n_words;
+      double frac = 1.0 - (double)done / (double)(words_total + 1);
+      th.alpha = alpha * (frac > 0.0001 ? frac : 0.0001);
     }
   }
 }
 
+// the nth output of splitmix64 started from seed
+static uint64_t splitmix64(uint64_t seed, uint64_t n)
+{
+  uint64_t z = seed + (n + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
 void EmbeddingTrainer::train()
 {
-  hidden_layer.clear();
-  hidden_layer.resize(vocab.size() * dimension, 0.0);
-  negative_layer.clear();
-  negative_layer.resize(vocab.size() * dimension, 0.0);
-  for (size_t i = 0; i < vocab.size() * dimension; i++) {
-    hidden_layer[i] = (frandom() - 0.5) / dimension;
-  }
-  for (size_t iteration = 0; iteration < min_count; iteration++) {
-    for (size_t sent = 0; sent < sentences.size(); sent++) {
-      for (size_t word = 0; word < sentences[sent].size(); word++) {
-        train_word(sent, word);
-      }
+  std::vector<EmbeddingThread> ths(threads);
+  hidden_layer.resize(vocab.size(), dimension);
+  negative_layer.resize(vocab.size(), dimension);
+  for (size_t i = 0; i < vocab.size(); i++) {
+    float* row = hidden_layer.row(i);
+    for (size_t j = 0; j < dimension; j++) {
+      row[j] = (float)((ths[0].frandom() - 0.5) / dimension);
     }
   }
+  // consecutive seeds would give the LCGs correlated streams
+  for (size_t t = 1; t < threads; t++) {
+    ths[t].current_random = splitmix64(ths[0].current_random, t);
+  }
+
+  // contiguous runs of sentences with about the same number of features
+  size_t n_sent = sentence_starts.size() - 1;
+  uint64_t feats = sentence_starts.back();
+  std::vector<size_t> bounds(1, 0);
+  for (size_t i = 0; i < n_sent; i++) {
+    if (bounds.size() < threads &&
+        sentence_starts[i] >= feats * bounds.size() / threads &&
+        i > bounds.back()) {
+      bounds.push_back(i);
+    }
+  }
+  while (bounds.size() <= threads) bounds.push_back(n_sent);
+
+  words_total = token_count * epochs;
+  words_done = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<size_t> running{threads};
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      train_range(ths[t], bounds[t], bounds[t+1]);
+      running--;
+    });
+  }
+  uint64_t total = words_total;
+  // the progress line is redrawn in place, which only works on a terminal
+  bool tty = isatty(STDERR_FILENO);
+  auto report = [&](bool done) {
+    double secs = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    uint64_t words = 0;
+    for (auto& th : ths) words += th.words.load(std::memory_order_relaxed);
+    std::cerr << "\rprogress: " << std::fixed << std::setprecision(1)
+              << std::setw(5)
+              << (total ? 100.0 * (double)words / (double)total : 100.0)
+              << "%  words/sec/thread: " << std::setprecision(0)
+              << (secs > 0 ? (double)words / secs / (double)threads : 0.0)
+              << std::defaultfloat;
+    if (done) std::cerr << std::endl;
+  };
+  for (size_t ticks = 1; running > 0; ticks++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (tty && ticks % 10 == 0) report(false);
+  }
+  for (auto& it : workers) it.join();
+  if (tty) report(true);
+  double secs = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  for (size_t t = 0; t < threads; t++) {
+    uint64_t words = ths[t].words.load(std::memory_order_relaxed);
+    std::cerr << "thread " << t << ": " << words << " words, "
+              << std::fixed << std::setprecision(0)
+              << (secs > 0 ? (double)words / secs : 0.0)
+              << std::defaultfloat << " words/sec" << std::endl;
+  }
 }
 
 void EmbeddingTrainer::write(UFILE* output)
@@ -207,8 +420,13 @@ void EmbeddingTrainer::write(UFILE* output)
       u_fprintf(output, "V F%d", i);
     }
     for (size_t j = 0; j < dimension; j++) {
-      u_fprintf(output, " %f", hidden_layer[(i * dimension) + j]);
+      u_fprintf(output, " %f", (double)hidden_layer.row(i)[j]);
     }
     u_fputc('\n', output);
   }
 }
+
+void EmbeddingTrainer::write_binary(FILE* output, bool half)
+{
+  write_embedding_file(output, vocab_pats, hidden_layer, half);
+}
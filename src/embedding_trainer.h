@@ -1,21 +1,66 @@
 #ifndef __SELECTOR_EMBED_TRAIN_H__
 #define __SELECTOR_EMBED_TRAIN_H__
 
-#include "lu.h"
+#include "embedding_file.h"
+#include "stream_reader.h"
+#include "vector_ops.h"
+#include <atomic>
 
 typedef sorted_vector<uint64_t> WordFeats;
+// marks the second and later features of a word in a flat corpus
+static const uint32_t CONTINUATION = 0x80000000u;
 // (count, feat)
 typedef std::pair<uint64_t, uint64_t> VocabWord;
 
+// the state of one training thread
+struct EmbeddingThread {
+  uint64_t current_random = 1;
+  // one row of dimension floats
+  FloatMatrix errors;
+  // learning rate, decayed as training progresses
+  double alpha = 0.0;
+  // tokens trained on so far, read by the progress report
+  std::atomic<uint64_t> words{0};
+  uint64_t random() {
+    return (current_random = (current_random * (uint64_t)25214903917 + 11));
+  }
+  float frandom() {
+    return ((random() & 0xFFFF) / (float)65536);
+  }
+};
+
+// Walker's alias method: draws index i with probability proportional
+// to the weight it was built with, in O(1) time and O(n) space
+class AliasTable {
+private:
+  // index i is kept with probability prob[i], otherwise alias[i] is used
+  std::vector<double> prob;
+  std::vector<uint32_t> alias;
+public:
+  void build(const std::vector<double>& weights);
+  bool empty() const { return prob.empty(); }
+  // r1 and r2 are independent random numbers
+  uint32_t draw(uint64_t r1, uint64_t r2) const {
+    size_t i = r1 % prob.size();
+    double u = (r2 & 0xFFFFFF) / (double)0x1000000;
+    return (u < prob[i] ? (uint32_t)i : alias[i]);
+  }
+};
+
 class EmbeddingTrainer {
 private:
   // settings
   uint64_t window = 5;
   uint64_t min_count = 5;
+  uint64_t epochs = 5;
+  // starting learning rate, decreasing linearly to alpha * 0.0001
   double alpha = 0.005;
-  uint64_t unigram_table_size = 1e8;
   uint64_t dimension = 100;
   uint64_t negative_samples = 0;
+  // if non-zero, randomly skip occurrences of features more frequent
+  // than this fraction of tokens, as in word2vec
+  double sample = 0.0;
+  size_t threads = 1;
 
   // calculated values
   uint64_t token_count = 0;
@@ -27,22 +72,33 @@ private:
   std::vector<UString> vocab_pats;
   std::map<UString, uint64_t> vocab_pats_inv;
 
-  std::vector<uint64_t> unigram_table;
+  // probability of keeping an occurrence of each feature,
+  // if subsampling
+  std::vector<float> keep_prob;
+  // tokens trained on by all threads, for the learning rate
+  std::atomic<uint64_t> words_done{0};
+  uint64_t words_total = 0;
 
-  std::vector<double> hidden_layer;
-  std::vector<double> negative_layer;
-  std::vector<double> errors;
+  // negative samples, drawn in proportion to count^0.75;
+  // index i is feature i+1, since UNK is never drawn
+  AliasTable negative_table;
 
-  std::vector<std::vector<LU*>> sentences_raw;
-  std::vector<std::vector<WordFeats>> sentences;
+  // with several threads, these are updated without locking,
+  // as in word2vec
+  // one row of dimension floats per feature
+  FloatMatrix hidden_layer;
+  FloatMatrix negative_layer;
 
-  uint64_t current_random = 1;
-  uint64_t random() {
-    return (current_random = (current_random * (uint64_t)25214903917 + 11));
-  }
-  float frandom() {
-    return ((random() & 0xFFFF) / (float)65536);
-  }
+  // the corpus as feature IDs: the first feature of each word, then
+  // any others with CONTINUATION set
+  // sentence i is tokens[sentence_starts[i] .. sentence_starts[i+1]]
+  std::vector<uint32_t> corpus;
+  std::vector<uint64_t> sentence_starts;
+  // corpus, or corpus_path mapped into memory once it is written there
+  const uint32_t* tokens = nullptr;
+  std::string corpus_path;
+  void* mapped = nullptr;
+  size_t mapped_len = 0;
 
   // pre-computed softmax
   std::vector<double> _exp_table;
@@ -51,21 +107,46 @@ private:
 
   double softmax(double f);
   void make_exp_table();
-  void init_unigram_table();
+  void init_negative_table();
+  void init_keep_prob();
 
   uint64_t get_or_create_feat(const UString& key);
   WordFeats get_keys(LU* l);
   void init_corpus();
   void trim_vocab();
-  void train_pair(uint64_t input, uint64_t output, bool neg);
-  void train_word(size_t sent_idx, size_t word_idx);
+  // move corpus to corpus_path and map it
+  void spill_corpus();
+  void train_pair(EmbeddingThread& th, uint64_t input, uint64_t output, bool neg);
+  // word_starts are the offsets in sent of each word,
+  // and of the end of the sentence
+  void train_word(EmbeddingThread& th, const uint32_t* sent,
+                  const std::vector<uint32_t>& word_starts, size_t word_idx);
+  // train on sentences [first, last) for every epoch
+  void train_range(EmbeddingThread& th, size_t first, size_t last);
 
 public:
   EmbeddingTrainer();
   ~EmbeddingTrainer();
-  void read_corpus(InputFile& input);
+  // LUs are only kept while their features are found
+  void read_corpus(StreamReader& input);
+  // keep the corpus in this file, mapped into memory, rather than on
+  // the heap
+  void set_corpus_file(const std::string& path) { corpus_path = path; }
+  void set_threads(size_t n) { threads = (n ? n : 1); }
+  // set before read_corpus()
+  void set_min_count(uint64_t n) { min_count = n; }
+  void set_sample(double t) { sample = t; }
+  void set_epochs(uint64_t n) { epochs = n; }
+  void set_window(uint64_t n) { window = n; }
+  void set_dimension(uint64_t n) { dimension = (n ? n : 1); }
+  void set_negative_samples(uint64_t n) { negative_samples = n; }
+  void set_alpha(double a) { alpha = a; }
+  // reports progress (when stderr is a terminal) and words/sec per
+  // thread to stderr
   void train();
   void write(UFILE* output);
+  // see embedding_file.h
+  void write_binary(FILE* output, bool half = false);
 };
 
 #endif
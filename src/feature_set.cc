@@ -1,10 +1,14 @@
 #include "feature_set.h"
+#include "profile.h"
 #include "file_header.h"
 #include <lttoolbox/compression.h>
 #include <lttoolbox/match_state.h>
 #include <lttoolbox/string_utils.h>
 #include <unicode/utf16.h>
+#include <algorithm>
 #include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <iostream>
 
@@ -115,6 +119,11 @@ void FeatureSet::clear()
   feature_names_inv.clear();
   feature_weights.clear();
   //pm.clear(); // TODO
+  if (mapped != nullptr) {
+    munmap(mapped, mapped_len);
+    mapped = nullptr;
+    mapped_len = 0;
+  }
 }
 
 void FeatureSet::read(InputFile& input)
@@ -173,9 +182,9 @@ void FeatureSet::read(InputFile& input)
           break;
         }
         if (f1 < f2) {
-          feature_weights[f1].insert(std::make_pair(f2, w));
+          feature_weights.insert(f1, f2, w);
         } else {
-          feature_weights[f2].insert(std::make_pair(f1, w));
+          feature_weights.insert(f2, f1, w);
         }
       }
       break;
@@ -200,24 +209,23 @@ void FeatureSet::write(UFILE* output)
       u_fprintf(output, "P %S %S\n", feature_names[i].c_str(), it.c_str());
     }
   }
-  for (auto& it : feature_weights) {
-    for (auto& it2 : it.second) {
-      if (it.first.second == 0) {
-        u_fprintf(output, "W %d:%S %f\n",
-                  it2.first.first, feature_names[it2.first.second].c_str(),
-                  it2.second);
-      } else {
-        u_fprintf(output, "W %d:%S %d:%S %f\n",
-                  it.first.first, feature_names[it.first.second].c_str(),
-                  it2.first.first, feature_names[it2.first.second].c_str(),
-                  it2.second);
-      }
+  for (auto& it : feature_weights.sorted()) {
+    auto& f1 = it.first.first;
+    auto& f2 = it.first.second;
+    if (f1.second == 0) {
+      u_fprintf(output, "W %d:%S %f\n",
+                f2.first, feature_names[f2.second].c_str(), it.second);
+    } else {
+      u_fprintf(output, "W %d:%S %d:%S %f\n",
+                f1.first, feature_names[f1.second].c_str(),
+                f2.first, feature_names[f2.second].c_str(), it.second);
     }
   }
 }
 
 void FeatureSet::load(FILE* input)
 {
+  clear();
   fpos_t pos;
   if (fgetpos(input, &pos) == 0) {
     char header[4]{};
@@ -227,6 +235,10 @@ void FeatureSet::load(FILE* input)
       if (features >= APSL_UNKNOWN) {
         throw std::runtime_error("This weights file has features that are unknown to this version of apertium-selector - upgrade!");
       }
+      if (features & APSL_MMAP) {
+        load_mapped(input);
+        return;
+      }
     } else {
       throw std::runtime_error("Weights file is missing header!");
     }
@@ -242,56 +254,122 @@ void FeatureSet::load(FILE* input)
     FeatLoc f1;
     f1.first = (int)Compression::multibyte_read(input) - (int)lookbehind;
     f1.second = Compression::multibyte_read(input);
-    feature_weights[f1].clear();
     for (auto len2 = Compression::multibyte_read(input); len2 > 0; len2--) {
       FeatLoc f2;
       f2.first = (int)Compression::multibyte_read(input) - (int)lookbehind;
       f2.second = Compression::multibyte_read(input);
       double weight = Compression::long_multibyte_read(input);
-      feature_weights[f1].insert(std::make_pair(f2, weight));
+      feature_weights.insert(f1, f2, weight);
     }
   }
 }
 
-void FeatureSet::compile(FILE* output)
+void FeatureSet::load_mapped(FILE* input)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  throw std::runtime_error("Memory-mapped weights files can only be loaded on little-endian machines - recompile without --mmap!");
+#endif
+  // settings
+  beam_size = Compression::multibyte_read(input);
+  lookbehind = Compression::multibyte_read(input);
+  lookahead = Compression::multibyte_read(input);
+  // FST
+  pm.read_fst(input);
+  // everything else is fixed-width arrays starting at the next
+  // 8-byte boundary, used directly from the page cache
+  long offset = ftell(input);
+  struct stat st;
+  if (offset < 0 || fstat(fileno(input), &st) != 0) {
+    throw std::runtime_error("Unable to determine size of weights file.");
+  }
+  size_t start = ((size_t)offset + 7) & ~(size_t)7;
+  mapped_len = (size_t)st.st_size;
+  if (start > mapped_len) {
+    throw std::runtime_error("Weights file is truncated.");
+  }
+  mapped = mmap(nullptr, mapped_len, PROT_READ, MAP_SHARED, fileno(input), 0);
+  if (mapped == MAP_FAILED) {
+    mapped = nullptr;
+    mapped_len = 0;
+    throw std::runtime_error("Unable to mmap weights file.");
+  }
+  const char* data = static_cast<const char*>(mapped) + start;
+  size_t len = mapped_len - start;
+  size_t used = pm.view_flat(data, len);
+  if (used == 0) {
+    throw std::runtime_error("Weights file has malformed feature table.");
+  }
+  if (feature_weights.view_flat(data + used, len - used) == 0) {
+    throw std::runtime_error("Weights file has malformed weight table.");
+  }
+}
+
+void FeatureSet::compile(FILE* output, bool mappable)
 {
   // header
   fwrite_unlocked(HEADER_APSL, 1, 4, output);
-  uint64_t header_features = 0;
+  uint64_t header_features = (mappable ? (uint64_t)APSL_MMAP : 0);
   write_le(output, header_features);
   // settings
   Compression::multibyte_write(beam_size, output);
   Compression::multibyte_write(lookbehind, output);
   Compression::multibyte_write(lookahead, output);
+  if (mappable) {
+    pm.write_fst(output);
+    // pad to 8 bytes so the arrays can be used in place
+    long offset = ftell(output);
+    if (offset < 0) {
+      throw std::runtime_error("Output for --mmap must be a seekable file.");
+    }
+    for (; offset % 8; offset++) fputc_unlocked(0, output);
+    pm.write_flat(output);
+    feature_weights.write_flat(output);
+    return;
+  }
   // FST
   pm.write(output);
-  // weights
-  Compression::multibyte_write(feature_weights.size(), output);
-  for (auto& it : feature_weights) {
-    Compression::multibyte_write(it.first.first + lookbehind, output);
-    Compression::multibyte_write(it.first.second, output);
-    Compression::multibyte_write(it.second.size(), output);
-    for (auto& it2 : it.second) {
-      Compression::multibyte_write(it2.first.first + lookbehind, output);
-      Compression::multibyte_write(it2.first.second, output);
-      Compression::long_multibyte_write(it2.second, output);
+  // weights, grouped by first feature
+  auto weights = feature_weights.sorted();
+  std::vector<size_t> groups;
+  for (size_t i = 0; i < weights.size(); i++) {
+    if (i == 0 || weights[i].first.first != weights[i-1].first.first) {
+      groups.push_back(i);
+    }
+  }
+  groups.push_back(weights.size());
+  Compression::multibyte_write(groups.size() - 1, output);
+  for (size_t g = 0; g + 1 < groups.size(); g++) {
+    auto& f1 = weights[groups[g]].first.first;
+    Compression::multibyte_write(f1.first + lookbehind, output);
+    Compression::multibyte_write(f1.second, output);
+    Compression::multibyte_write(groups[g+1] - groups[g], output);
+    for (size_t i = groups[g]; i < groups[g+1]; i++) {
+      auto& f2 = weights[i].first.second;
+      Compression::multibyte_write(f2.first + lookbehind, output);
+      Compression::multibyte_write(f2.second, output);
+      Compression::long_multibyte_write(weights[i].second, output);
     }
   }
 }
 
-LU* FeatureSet::read_lu(InputFile& input)
+LU* FeatureSet::read_lu(StreamReader& input)
 {
   LU* ret = new LU();
-  ret->read(input, pm.get_alpha());
-  if (ret->get_src() != nullptr) {
-    ret->get_src()->add_feat(0);
-    pm.get_features(ret->get_src(), true, ret->get_src()->get_feats());
+  read_lu(input, ret);
+  return ret;
+}
+
+void FeatureSet::read_lu(StreamReader& input, LU* lu, MatchCache& cache)
+{
+  input.read_lu(lu, pm.get_alpha());
+  if (lu->get_src() != nullptr) {
+    lu->get_src()->add_feat(0);
+    pm.get_features(lu->get_src(), true, lu->get_src()->get_feats(), cache);
   }
-  for (auto& t : ret->get_trg()) {
+  for (auto& t : lu->get_trg()) {
     t->add_feat(0);
-    pm.get_features(t, false, t->get_feats());
+    pm.get_features(t, false, t->get_feats(), cache);
   }
-  return ret;
 }
 
 double FeatureSet::get_weight(FeatSet& feats)
@@ -303,30 +381,74 @@ double FeatureSet::get_weight(FeatSet& feats)
 double FeatureSet::get_weight(FeatSet& feats, FeatPairSet& used_feats)
 {
   double ret = 0.0;
-  auto vec = feats.get();
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+  const auto& vec = feats.get();
   for (size_t i = 0; i < vec.size(); i++) {
-    auto loc = feature_weights.find(vec[i]);
-    if (loc == feature_weights.end()) continue;
-    auto dct = loc->second;
+    if (!feature_weights.has_first(vec[i])) continue;
+    lookups += vec.size() - i - 1;
     for (size_t j = i+1; j < vec.size(); j++) {
-      auto loc2 = dct.find(vec[j]);
-      if (loc2 == dct.end()) continue;
-      ret += loc2->second;
+      const double* w = feature_weights.find(vec[i], vec[j]);
+      if (w == nullptr) continue;
+      hits++;
+      ret += *w;
       used_feats.insert(std::make_pair(vec[i], vec[j]));
     }
   }
+  PROFILE_COUNT(lookups, lookups);
+  PROFILE_COUNT(hits, hits);
   return ret;
 }
 
-std::map<FeatPair, double> FeatureSet::get_all_weights()
+void FeatureSet::get_matches(FeatSet& feats, std::vector<WeightedPair>& out)
 {
-  std::map<FeatPair, double> ret;
-  for (auto& a : feature_weights) {
-    for (auto& b : a.second) {
-      ret.insert(std::make_pair(std::make_pair(a.first, b.first), b.second));
+  size_t start = out.size();
+  uint64_t lookups = 0;
+  const auto& vec = feats.get();
+  for (size_t i = 0; i < vec.size(); i++) {
+    if (!feature_weights.has_first(vec[i])) continue;
+    lookups += vec.size() - i - 1;
+    for (size_t j = i+1; j < vec.size(); j++) {
+      const double* w = feature_weights.find(vec[i], vec[j]);
+      if (w == nullptr) continue;
+      out.push_back(std::make_pair(std::make_pair(vec[i], vec[j]), *w));
     }
   }
-  return ret;
+  PROFILE_COUNT(lookups, lookups);
+  PROFILE_COUNT(hits, out.size() - start);
+}
+
+void FeatureSet::get_matches(FeatSet& feats1, FeatSet& feats2,
+                             std::vector<WeightedPair>& out)
+{
+  if (feats1.empty() || feats2.empty()) return;
+  size_t start = out.size();
+  uint64_t lookups = 0;
+  // kept between calls so that scoring doesn't allocate per hypothesis
+  static thread_local std::vector<bool> heads2;
+  heads2.clear();
+  for (auto& f2 : feats2) heads2.push_back(feature_weights.has_first(f2));
+  for (auto& f1 : feats1) {
+    bool head1 = feature_weights.has_first(f1);
+    size_t j = 0;
+    for (auto& f2 : feats2) {
+      const double* w = nullptr;
+      if (f1 < f2) {
+        if (head1) w = feature_weights.find(f1, f2);
+      } else {
+        if (heads2[j]) w = feature_weights.find(f2, f1);
+      }
+      if (f1 < f2 ? head1 : heads2[j]) lookups++;
+      if (w != nullptr) {
+        if (f1 < f2) out.push_back(std::make_pair(std::make_pair(f1, f2), *w));
+        else out.push_back(std::make_pair(std::make_pair(f2, f1), *w));
+      }
+      j++;
+    }
+  }
+  PROFILE_COUNT(lookups, lookups);
+  PROFILE_COUNT(hits, out.size() - start);
+  std::sort(out.begin() + (long)start, out.end());
 }
 
 double FeatureSet::get_weight(FeatPair fp)
@@ -339,19 +461,15 @@ double FeatureSet::get_weight(FeatPair fp)
     f1 = fp.second;
     f2 = fp.first;
   }
-  auto loc = feature_weights.find(f1);
-  if (loc != feature_weights.end()) {
-    auto loc2 = loc->second.find(f2);
-    return (loc2 == loc->second.end() ? 0.0 : loc2->second);
-  }
-  return 0.0;
+  const double* w = feature_weights.find(f1, f2);
+  return (w == nullptr ? 0.0 : *w);
 }
 
 void FeatureSet::set_weight(FeatPair fp, double w)
 {
   if (fp.first < fp.second) {
-    feature_weights[fp.first][fp.second] = w;
+    feature_weights.set(fp.first, fp.second, w);
   } else {
-    feature_weights[fp.second][fp.first] = w;
+    feature_weights.set(fp.second, fp.first, w);
   }
 }
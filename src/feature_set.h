@@ -2,6 +2,12 @@
 #define __SELECTOR_RULES_H__
 
 #include "pattern_matcher.h"
+#include "stream_reader.h"
+#include "weight_table.h"
+#include <lttoolbox/input_file.h>
+
+// a pair that has a weight, and its weight
+typedef std::pair<FeatPair, double> WeightedPair;
 
 class FeatureSet {
 private:
@@ -12,25 +18,49 @@ private:
   PatternMatcher pm;
   std::vector<UString> feature_names;
   std::map<UString, uint64_t> feature_names_inv;
-  // feat1 => feat2 => weight
-  std::map<FeatLoc, std::map<FeatLoc, double>> feature_weights;
+  // (feat1, feat2) => weight, feat1 < feat2
+  WeightTable feature_weights;
+  // memory-mapped compiled file, if loaded from the mmap format
+  void* mapped = nullptr;
+  size_t mapped_len = 0;
   bool parse_featloc(const UString& tok, FeatLoc& fl);
   void parse_single_number(InputFile& input, UChar32 c);
   void clear();
+  void load_mapped(FILE* input);
 public:
   FeatureSet();
   ~FeatureSet();
   void read(InputFile& input);
   void write(UFILE* output);
   void load(FILE* input);
-  void compile(FILE* output);
-  LU* read_lu(InputFile& input);
+  // if mappable, write the format that load() can use in place
+  void compile(FILE* output, bool mappable = false);
+  LU* read_lu(StreamReader& input);
+  // read into an existing (cleared) LU so its storage can be reused
+  void read_lu(StreamReader& input, LU* lu) { read_lu(input, lu, pm.get_cache()); }
+  // the same, remembering matches in cache rather than this FeatureSet's,
+  // so that several threads can read at once
+  void read_lu(StreamReader& input, LU* lu, MatchCache& cache);
   double get_weight(FeatSet& feats);
   double get_weight(FeatSet& feats, FeatPairSet& used_feats);
+  // append the pairs in feats that have weights to out,
+  // in the order get_weight(feats) adds them
+  void get_matches(FeatSet& feats, std::vector<WeightedPair>& out);
+  // the same for the pairs with one feature from each set, which should
+  // be disjoint; the appended pairs are sorted by (first, second), which
+  // is the order get_weight() would add them in if the sets were merged
+  void get_matches(FeatSet& feats1, FeatSet& feats2, std::vector<WeightedPair>& out);
   size_t get_beam_size() { return beam_size; }
   size_t get_lookahead() { return lookahead; }
   size_t get_lookbehind() { return lookbehind; }
-  std::map<FeatPair, double> get_all_weights();
+  std::vector<std::vector<UString>>& get_patterns() { return pm.get_patterns(); }
+  Alphabet& get_alpha() { return pm.get_alpha(); }
+  bool determinize(size_t max_states) { return pm.determinize(max_states); }
+  void set_cache_size(size_t n) { pm.set_cache_size(n); }
+  uint64_t get_cache_hits() { return pm.get_cache_hits(); }
+  uint64_t get_cache_misses() { return pm.get_cache_misses(); }
+  // all pairs and their weights, in order
+  std::vector<WeightedPair> get_sorted_weights() { return feature_weights.sorted(); }
   double get_weight(FeatPair fp);
   void set_weight(FeatPair fp, double w);
 };
@@ -3,8 +3,18 @@
 
 constexpr char HEADER_APSL[4]{'A', 'P', 'S', 'L'};
 enum APSL_FEATURES : uint64_t {
-  APSL_UNKNOWN = (1ull << 0),
+  // weights and feature states are fixed-width arrays that can be mmapped
+  APSL_MMAP = (1ull << 0),
+  APSL_UNKNOWN = (1ull << 1),
   APSL_RESERVED = (1ull << 63),
 };
 
+constexpr char HEADER_APSE[4]{'A', 'P', 'S', 'E'};
+enum APSE_FEATURES : uint64_t {
+  // vectors are float16 rather than float32
+  APSE_FLOAT16 = (1ull << 0),
+  APSE_UNKNOWN = (1ull << 1),
+  APSE_RESERVED = (1ull << 63),
+};
+
 #endif
@@ -1,28 +1,18 @@
 #include "lu.h"
 #include <algorithm>
 
-void Reading::read(InputFile& input, const Alphabet& alpha)
+void Reading::clear()
 {
-  while (!input.eof()) {
-    UChar32 c = input.get();
-    if (c == '\0' || c == '/' || c == '$') {
-      input.unget(c);
-      break;
-    }
-    if (c == '\\') {
-      form += c;
-      c = input.get();
-      form += c;
-      symbols.push_back(static_cast<int32_t>(c));
-    } else if (c == '<') {
-      UString tag = input.readBlock('<', '>');
-      form += tag;
-      symbols.push_back(alpha(tag));
-    } else {
-      form += c;
-      symbols.push_back(static_cast<int32_t>(c));
-    }
-  }
+  raw.clear();
+  form.clear();
+  symbols.clear();
+  feats.clear();
+}
+
+UString& Reading::get_form()
+{
+  if (form.empty() && !raw.empty()) form = to_ustring(raw.c_str());
+  return form;
 }
 
 void Reading::get_feats(int idx, FeatSet& feat_ls)
@@ -34,57 +24,86 @@ LU::~LU()
 {
   if (src != nullptr) delete src;
   for (auto& r : trg) delete r;
+  for (auto& r : spare) delete r;
 }
 
-void LU::read(InputFile& input, const Alphabet& alpha)
+Reading* LU::new_reading()
 {
-  blank = input.readBlank(true);
-  if (!input.eof() && input.peek() == '^') {
-    input.get();
-    src = new Reading();
-    src->read(input, alpha);
-    while (!input.eof() && input.peek() == '/') {
-      input.get();
-      Reading* t = new Reading();
-      t->read(input, alpha);
-      trg.push_back(t);
-    }
-    if (!input.eof() && input.peek() == '$') {
-      input.get();
-    }
+  if (spare.empty()) return new Reading();
+  Reading* ret = spare.back();
+  spare.pop_back();
+  return ret;
+}
+
+void LU::clear()
+{
+  if (src != nullptr) {
+    src->clear();
+    spare.push_back(src);
+    src = nullptr;
+  }
+  for (auto& r : trg) {
+    r->clear();
+    spare.push_back(r);
+  }
+  trg.clear();
+  blank.clear();
+}
+
+void LU::assign(const LU& other)
+{
+  clear();
+  blank = other.blank;
+  if (other.src != nullptr) {
+    src = new_reading();
+    *src = *other.src;
+  }
+  for (auto& r : other.trg) {
+    Reading* t = new_reading();
+    *t = *r;
+    trg.push_back(t);
   }
 }
 
-void LU::write(UFILE* output, size_t selected,
+void LU::write(StreamWriter& output, size_t selected,
                bool selected_first, bool with_surf)
 {
-  ::write(blank, output);
+  output.write(blank);
   if (src != nullptr) {
-    u_fputc('^', output);
+    output.put('^');
     if (with_surf) src->write(output);
     if (selected < trg.size()) {
-      if (with_surf) u_fputc('/', output);
+      if (with_surf) output.put('/');
       trg[selected]->write(output);
     }
     if (selected_first) {
       for (size_t i = 0; i < trg.size(); i++) {
         if (i == selected) continue;
-        u_fputc('/', output);
+        output.put('/');
         trg[i]->write(output);
       }
     }
-    u_fputc('$', output);
+    output.put('$');
   }
 }
 
 void LU::keep_only(size_t idx)
 {
+  if (idx >= trg.size()) {
+    for (auto& r : trg) {
+      r->clear();
+      spare.push_back(r);
+    }
+    trg.clear();
+    return;
+  }
   for (size_t i = 0; i < trg.size(); i++) {
-    if (i != idx) delete trg[i];
+    if (i == idx) continue;
+    trg[i]->clear();
+    spare.push_back(trg[i]);
   }
-  std::vector<Reading*> temp;
-  if (idx < trg.size()) temp.push_back(trg[idx]);
-  temp.swap(trg);
+  trg[0] = trg[idx];
+  trg.resize(1);
 }
 
 size_t LU::after_newline()
@@ -1,11 +1,12 @@
 #ifndef __SELECTOR_LU_H__
 #define __SELECTOR_LU_H__
 
+#include "stream_writer.h"
 #include <lttoolbox/alphabet.h>
-#include <lttoolbox/input_file.h>
 #include <lttoolbox/sorted_vector.hpp>
 #include <lttoolbox/ustring.h>
 #include <unicode/ustdio.h>
+#include <string>
 #include <vector>
 
 // (pos, feat)
@@ -21,38 +22,51 @@ typedef sorted_vector<FeatPair> FeatPairSet;
 
 class Reading {
 private:
+  // the reading as it appeared in the input, in UTF-8
+  std::string raw;
+  // raw as UTF-16, only converted when asked for
   UString form;
   std::vector<int32_t> symbols;
   sorted_vector<uint64_t> feats;
 public:
-  void read(InputFile& input, const Alphabet& alpha);
-  void write(UFILE* output) { ::write(form, output); }
-  UString& get_form() { return form; }
+  // empty, but keep allocated capacity
+  void clear();
+  void write(StreamWriter& output) { output.write(raw); }
+  std::string& get_raw() { return raw; }
+  UString& get_form();
   std::vector<int32_t>& get_symbols() { return symbols; }
   sorted_vector<uint64_t>& get_feats() { return feats; }
   void get_feats(int idx, FeatSet& feat_ls);
   void add_feat(uint64_t feat) { feats.insert(feat); }
+  friend class StreamReader;
 };
 
 class LU {
 private:
   Reading* src = nullptr;
   std::vector<Reading*> trg;
-  UString blank; // preceding blank
+  // cleared readings kept for reuse by read()
+  std::vector<Reading*> spare;
+  std::string blank; // preceding blank, in UTF-8
+  Reading* new_reading();
 public:
   ~LU();
-  void read(InputFile& input, const Alphabet& alpha);
-  void write(UFILE* output, size_t selected,
+  // empty, but keep readings and their capacity for the next read()
+  void clear();
+  // make this a deep copy of other
+  void assign(const LU& other);
+  void write(StreamWriter& output, size_t selected,
              bool selected_first = false, bool with_surf = true);
   // return true if multiple readings
   // and false if 1 reading or this is stream-final blank
   bool ambiguous() { return trg.size() > 1; }
   bool isEOF() { return src == nullptr; }
-  UString& get_blank() { return blank; }
+  std::string& get_blank() { return blank; }
   Reading* get_src() { return src; }
   std::vector<Reading*>& get_trg() { return trg; }
   void keep_only(size_t idx);
   size_t after_newline();
+  friend class StreamReader;
 };
 
 #endif
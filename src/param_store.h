@@ -0,0 +1,46 @@
+#ifndef __SELECTOR_PARAM_STORE_H__
+#define __SELECTOR_PARAM_STORE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// averaged perceptron parameters in contiguous arrays, indexed by the
+// rank of each weight pair (see SelectorTrainer::pairs)
+// totals are brought up to date lazily when a weight changes and once
+// for every weight by average()
+class ParamStore {
+public:
+  std::vector<double> weights;
+  std::vector<double> totals;
+  std::vector<uint64_t> last_update;
+  uint64_t cur_inst = 0;
+
+  // totals start at the current weights rather than 0,
+  // as they always have
+  void begin_epoch()
+  {
+    totals = weights;
+    last_update.assign(weights.size(), 0);
+    cur_inst = 0;
+  }
+  void update(size_t k, double d)
+  {
+    totals[k] += weights[k] * (double)(cur_inst - last_update[k]);
+    last_update[k] = cur_inst;
+    weights[k] += d;
+  }
+  // replace every weight that changed this epoch with its average
+  void average()
+  {
+    if (cur_inst == 0) return;
+    for (size_t k = 0; k < weights.size(); k++) {
+      if (last_update[k] > 0) {
+        totals[k] += weights[k] * (double)(cur_inst - last_update[k]);
+        weights[k] = totals[k] / (double)cur_inst;
+      }
+    }
+  }
+};
+
+#endif
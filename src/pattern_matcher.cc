@@ -1,7 +1,19 @@
 #include "pattern_matcher.h"
+#include "profile.h"
 #include <lttoolbox/compression.h>
 #include <lttoolbox/match_state.h>
 #include <lttoolbox/string_utils.h>
+#include <algorithm>
+
+size_t SymbolSeqHash::operator()(const std::vector<int32_t>& seq) const
+{
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (auto& sym : seq) {
+    h ^= (uint32_t)sym;
+    h *= 0x100000001B3ull;
+  }
+  return (size_t)h;
+}
 
 PatternMatcher::PatternMatcher()
 {
@@ -9,25 +21,78 @@ PatternMatcher::PatternMatcher()
 
 PatternMatcher::~PatternMatcher()
 {
+  delete me;
+}
+
+void MatchCache::set_size(size_t n)
+{
+  max_entries = n;
+  while (entries.size() > max_entries) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
 }
 
 void PatternMatcher::get_features(Reading* reading, bool is_src,
-                                  sorted_vector<uint64_t>& feats)
+                                  sorted_vector<uint64_t>& feats,
+                                  MatchCache& c) const
 {
   if (reading == nullptr) return;
+  PROFILE_SCOPE(PROF_MATCH);
+  if (c.max_entries == 0) {
+    match(reading, is_src, feats);
+    return;
+  }
+  c.key.clear();
+  c.key.push_back(is_src ? 1 : 0);
+  c.key.insert(c.key.end(), reading->get_symbols().begin(),
+               reading->get_symbols().end());
+  auto loc = c.index.find(c.key);
+  if (loc != c.index.end()) {
+    c.hits++;
+    c.entries.splice(c.entries.begin(), c.entries, loc->second);
+    auto& found = loc->second->second;
+    feats.insert(found.begin(), found.end());
+    return;
+  }
+  c.misses++;
+  sorted_vector<uint64_t> found;
+  match(reading, is_src, found);
+  feats.insert(found.begin(), found.end());
+  if (c.entries.size() >= c.max_entries) {
+    c.index.erase(c.entries.back().first);
+    c.entries.pop_back();
+  }
+  c.entries.push_front(std::make_pair(c.key, found.get()));
+  c.index.insert(std::make_pair(c.key, c.entries.begin()));
+}
+
+void PatternMatcher::match(Reading* reading, bool is_src,
+                           sorted_vector<uint64_t>& feats) const
+{
+  if (!dfa_table.empty()) {
+    match_dfa(reading, is_src, feats);
+    return;
+  }
   MatchState ms;
   ms.init(me->getInitial());
   ms.step(is_src ? sl_sym : tl_sym);
   for (auto& sym : reading->get_symbols()) {
-    ms.step(alpha(sym, sym), (sym < 0 ? any_tag : any_char));
+    // a symbol on no arc can only match a wildcard
+    auto label = sym_labels.find(sym);
+    if (label == sym_labels.end()) ms.step(sym < 0 ? any_tag : any_char);
+    else ms.step(label->second, (sym < 0 ? any_tag : any_char));
   }
   std::set<int> states;
   while (true) {
     int state = ms.classifyFinals(me->getFinals(), states);
     if (state != -1) {
-      auto rng = feature_states.equal_range(state);
-      for (auto it = rng.first; it != rng.second; it++) {
-        feats.insert(it->second);
+      auto it = std::lower_bound(fstates, fstates + fstates_len, (uint64_t)state,
+                                 [](const FeatureState& a, uint64_t b) {
+                                   return a.state < b;
+                                 });
+      for (; it != fstates + fstates_len && it->state == (uint64_t)state; it++) {
+        feats.insert(it->feat);
       }
       states.insert(state);
     } else {
@@ -36,6 +101,134 @@ void PatternMatcher::get_features(Reading* reading, bool is_src,
   }
 }
 
+void PatternMatcher::match_dfa(Reading* reading, bool is_src,
+                               sorted_vector<uint64_t>& feats) const
+{
+  uint32_t state = (is_src ? dfa_start_sl : dfa_start_tl);
+  for (auto& sym : reading->get_symbols()) {
+    if (state == 0) return;
+    int32_t cls;
+    if (0 <= sym && sym < 128) {
+      cls = dfa_ascii[sym];
+    } else {
+      auto loc = dfa_classes.find(sym);
+      if (loc != dfa_classes.end()) cls = loc->second;
+      else cls = (sym < 0 ? 1 : 0);
+    }
+    state = dfa_table[state * dfa_width + (size_t)cls];
+  }
+  for (uint32_t i = dfa_final[state]; i < dfa_final[state+1]; i++) {
+    feats.insert(dfa_feats[i]);
+  }
+}
+
+bool PatternMatcher::determinize(size_t max_states)
+{
+  dfa_table.clear();
+  dfa_final.clear();
+  dfa_feats.clear();
+  dfa_classes.clear();
+  auto& transitions = trans.getTransitions();
+  // group symbols into classes
+  // all transitions are sym:sym, so the input side is enough
+  std::map<int32_t, int32_t> label_class;
+  std::vector<bool> class_is_tag = {false, true};
+  for (auto& state : transitions) {
+    for (auto& arc : state.second) {
+      int32_t label = arc.first;
+      if (label == 0 || label == any_char || label == any_tag) continue;
+      if (label_class.count(label)) continue;
+      int32_t sym = alpha.decode(label).first;
+      auto loc = dfa_classes.find(sym);
+      if (loc == dfa_classes.end()) {
+        int32_t cls = (int32_t)class_is_tag.size();
+        class_is_tag.push_back(sym < 0);
+        loc = dfa_classes.insert(std::make_pair(sym, cls)).first;
+      }
+      label_class[label] = loc->second;
+    }
+  }
+  dfa_width = class_is_tag.size();
+  for (int32_t c = 0; c < 128; c++) {
+    auto loc = dfa_classes.find(c);
+    dfa_ascii[c] = (loc == dfa_classes.end() ? 0 : loc->second);
+  }
+  for (int32_t c = 0; c < 128; c++) dfa_classes.erase(c);
+
+  std::map<uint64_t, std::vector<uint64_t>> state_feats;
+  for (size_t i = 0; i < fstates_len; i++) {
+    state_feats[fstates[i].state].push_back(fstates[i].feat);
+  }
+
+  // subset construction, subsets are sorted lists of transducer states
+  std::map<std::vector<int>, uint32_t> ids;
+  std::vector<std::vector<int>> subsets;
+  auto get_id = [&](std::vector<int>& subset) -> uint32_t {
+    std::sort(subset.begin(), subset.end());
+    subset.erase(std::unique(subset.begin(), subset.end()), subset.end());
+    auto loc = ids.find(subset);
+    if (loc != ids.end()) return loc->second;
+    uint32_t id = (uint32_t)subsets.size();
+    ids.insert(std::make_pair(subset, id));
+    subsets.push_back(subset);
+    return id;
+  };
+  std::vector<int> subset;
+  get_id(subset); // dead state
+  // the side symbol is stepped without wildcards
+  auto initial = transitions.find(trans.getInitial());
+  for (auto side : {sl_sym, tl_sym}) {
+    subset.clear();
+    if (initial != transitions.end()) {
+      auto rng = initial->second.equal_range(side);
+      for (auto it = rng.first; it != rng.second; it++) {
+        subset.push_back(it->second.first);
+      }
+    }
+    (side == sl_sym ? dfa_start_sl : dfa_start_tl) = get_id(subset);
+  }
+  std::vector<std::vector<int>> next(dfa_width);
+  for (uint32_t cur = 0; cur < subsets.size(); cur++) {
+    if (subsets.size() > max_states) {
+      dfa_table.clear();
+      dfa_final.clear();
+      return false;
+    }
+    for (auto& n : next) n.clear();
+    for (auto& st : subsets[cur]) {
+      auto loc = transitions.find(st);
+      if (loc == transitions.end()) continue;
+      for (auto& arc : loc->second) {
+        int dest = arc.second.first;
+        if (arc.first == any_char || arc.first == any_tag) {
+          bool tag = (arc.first == any_tag);
+          for (size_t c = 0; c < dfa_width; c++) {
+            if (class_is_tag[c] == tag) next[c].push_back(dest);
+          }
+        } else {
+          auto cls = label_class.find(arc.first);
+          if (cls != label_class.end()) {
+            next[(size_t)cls->second].push_back(dest);
+          }
+        }
+      }
+    }
+    for (size_t c = 0; c < dfa_width; c++) {
+      dfa_table.push_back(get_id(next[c]));
+    }
+    dfa_final.push_back((uint32_t)dfa_feats.size());
+    sorted_vector<uint64_t> feats;
+    for (auto& st : subsets[cur]) {
+      auto loc = state_feats.find((uint64_t)st);
+      if (loc == state_feats.end()) continue;
+      feats.insert(loc->second.begin(), loc->second.end());
+    }
+    dfa_feats.insert(dfa_feats.end(), feats.begin(), feats.end());
+  }
+  dfa_final.push_back((uint32_t)dfa_feats.size());
+  return true;
+}
+
 void PatternMatcher::add_pattern(size_t id, const UString& pat)
 {
   while (patterns.size() <= id) {
@@ -53,16 +246,41 @@ int32_t rule_number(Alphabet& a, uint64_t n)
   return a(sym);
 }
 
+void PatternMatcher::init_symbols()
+{
+  any_char = alpha(alpha(Transducer::ANY_CHAR_SYMBOL), alpha(Transducer::ANY_CHAR_SYMBOL));
+  any_tag = alpha(alpha(Transducer::ANY_TAG_SYMBOL), alpha(Transducer::ANY_TAG_SYMBOL));
+  sl_sym = alpha(alpha("<side:sl>"_u), alpha("<side:sl>"_u));
+  tl_sym = alpha(alpha("<side:tl>"_u), alpha("<side:tl>"_u));
+}
+
+void PatternMatcher::init_matcher()
+{
+  std::map<int, int> state_list;
+  for (size_t i = 0; i < fstates_len; i++) {
+    int state = (int)fstates[i].state;
+    state_list.insert(std::make_pair(state, state));
+  }
+  delete me;
+  me = new MatchExe(trans, state_list);
+  // all transitions are sym:sym
+  sym_labels.clear();
+  for (auto& state : trans.getTransitions()) {
+    for (auto& arc : state.second) {
+      int32_t label = arc.first;
+      if (label == 0 || label == any_char || label == any_tag) continue;
+      sym_labels[alpha.decode(label).first] = label;
+    }
+  }
+}
+
 void PatternMatcher::build_trans()
 {
   alpha.includeSymbol(Transducer::ANY_CHAR_SYMBOL);
   alpha.includeSymbol(Transducer::ANY_TAG_SYMBOL);
   alpha.includeSymbol("<side:sl>"_u);
   alpha.includeSymbol("<side:tl>"_u);
-  any_char = alpha(alpha(Transducer::ANY_CHAR_SYMBOL), alpha(Transducer::ANY_CHAR_SYMBOL));
-  any_tag = alpha(alpha(Transducer::ANY_TAG_SYMBOL), alpha(Transducer::ANY_TAG_SYMBOL));
-  sl_sym = alpha(alpha("<side:sl>"_u), alpha("<side:sl>"_u));
-  tl_sym = alpha(alpha("<side:tl>"_u), alpha("<side:tl>"_u));
+  init_symbols();
   std::map<int32_t, size_t> final_syms;
   int sl_state = trans.insertSingleTransduction(sl_sym, 0);
   int tl_state = trans.insertSingleTransduction(tl_sym, 0);
@@ -124,47 +342,85 @@ void PatternMatcher::build_trans()
   trans.minimize();
   feature_states.clear();
   auto old_finals = trans.getFinals();
-  std::map<int, int> state_list;
   for (auto& state : trans.getTransitions()) {
     for (auto& arc : state.second) {
       if (!final_syms.count(arc.first)) continue;
       if (!trans.isFinal(arc.second.first)) continue;
       trans.setFinal(state.first);
-      state_list.insert(std::make_pair(state.first, state.first));
-      feature_states.insert(std::make_pair(state.first, final_syms[arc.first]));
+      feature_states.push_back(FeatureState{(uint64_t)state.first,
+                                            final_syms[arc.first]});
     }
   }
   for (auto& it : old_finals) {
     trans.setFinal(it.first, it.second, false);
   }
-  me = new MatchExe(trans, state_list);
+  std::stable_sort(feature_states.begin(), feature_states.end(),
+                   [](const FeatureState& a, const FeatureState& b) {
+                     return a.state < b.state;
+                   });
+  fstates = feature_states.data();
+  fstates_len = feature_states.size();
+  init_matcher();
 }
 
-void PatternMatcher::read(FILE* input)
+void PatternMatcher::read_fst(FILE* input)
 {
   alpha.read(input);
-  any_char = alpha(alpha(Transducer::ANY_CHAR_SYMBOL), alpha(Transducer::ANY_CHAR_SYMBOL));
-  any_tag = alpha(alpha(Transducer::ANY_TAG_SYMBOL), alpha(Transducer::ANY_TAG_SYMBOL));
-  sl_sym = alpha(alpha("<side:sl>"_u), alpha("<side:sl>"_u));
-  tl_sym = alpha(alpha("<side:tl>"_u), alpha("<side:tl>"_u));
+  init_symbols();
   trans.read(input);
-  std::map<int, int> state_list;
+}
+
+void PatternMatcher::write_fst(FILE* output)
+{
+  alpha.write(output);
+  trans.write(output);
+}
+
+void PatternMatcher::read(FILE* input)
+{
+  read_fst(input);
+  feature_states.clear();
   for (auto len = Compression::multibyte_read(input); len > 0; len--) {
-    int state = (int)Compression::multibyte_read(input);
+    uint64_t state = Compression::multibyte_read(input);
     uint64_t feat = Compression::multibyte_read(input);
-    feature_states.insert(std::make_pair(state, feat));
-    state_list.insert(std::make_pair(state, state));
+    feature_states.push_back(FeatureState{state, feat});
   }
-  me = new MatchExe(trans, state_list);
+  std::stable_sort(feature_states.begin(), feature_states.end(),
+                   [](const FeatureState& a, const FeatureState& b) {
+                     return a.state < b.state;
+                   });
+  fstates = feature_states.data();
+  fstates_len = feature_states.size();
+  init_matcher();
 }
 
 void PatternMatcher::write(FILE* output)
 {
-  alpha.write(output);
-  trans.write(output);
-  Compression::multibyte_write(feature_states.size(), output);
-  for (auto& it : feature_states) {
-    Compression::multibyte_write(it.first, output);
-    Compression::multibyte_write(it.second, output);
+  write_fst(output);
+  Compression::multibyte_write(fstates_len, output);
+  for (size_t i = 0; i < fstates_len; i++) {
+    Compression::multibyte_write(fstates[i].state, output);
+    Compression::multibyte_write(fstates[i].feat, output);
+  }
+}
+
+void PatternMatcher::write_flat(FILE* output)
+{
+  write_le<uint64_t>(output, fstates_len);
+  for (size_t i = 0; i < fstates_len; i++) {
+    write_le<uint64_t>(output, fstates[i].state);
+    write_le<uint64_t>(output, fstates[i].feat);
   }
 }
+
+size_t PatternMatcher::view_flat(const char* data, size_t len)
+{
+  if (len < sizeof(uint64_t)) return 0;
+  size_t n = *reinterpret_cast<const uint64_t*>(data);
+  if (n > (len - sizeof(uint64_t)) / sizeof(FeatureState)) return 0;
+  feature_states.clear();
+  fstates = reinterpret_cast<const FeatureState*>(data + sizeof(uint64_t));
+  fstates_len = n;
+  init_matcher();
+  return sizeof(uint64_t) + n*sizeof(FeatureState);
+}
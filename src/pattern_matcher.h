@@ -4,6 +4,34 @@
 #include "lu.h"
 #include <lttoolbox/match_exe.h>
 #include <lttoolbox/transducer.h>
+#include <list>
+#include <unordered_map>
+
+// final state => feature it signals
+// stored sorted by state so that it can be written and mapped as an array
+struct FeatureState {
+  uint64_t state;
+  uint64_t feat;
+};
+
+struct SymbolSeqHash {
+  size_t operator()(const std::vector<int32_t>& seq) const;
+};
+
+// side + symbols => matched features, most recently used first
+// each Selector session keeps its own, so that sessions sharing a
+// PatternMatcher (apertium-selector --socket) don't contend for it
+struct MatchCache {
+  typedef std::list<std::pair<std::vector<int32_t>, std::vector<uint64_t>>> Entries;
+  Entries entries;
+  std::unordered_map<std::vector<int32_t>, Entries::iterator, SymbolSeqHash> index;
+  std::vector<int32_t> key;
+  size_t max_entries = 10000;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  // maximum number of distinct readings to remember, 0 to disable
+  void set_size(size_t n);
+};
 
 class PatternMatcher
 {
@@ -12,21 +40,72 @@ private:
   Alphabet alpha;
   Transducer trans;
   MatchExe* me = nullptr;
-  std::multimap<int, uint64_t> feature_states;
+  std::vector<FeatureState> feature_states;
+  // either feature_states.data() or an array in a memory-mapped file
+  const FeatureState* fstates = nullptr;
+  size_t fstates_len = 0;
   int32_t any_char = 0;
   int32_t any_tag = 0;
   int32_t sl_sym = 0;
   int32_t tl_sym = 0;
+
+  // transducer label of each symbol that appears on an arc, so that
+  // matching doesn't add pairs to alpha and can run on several
+  // threads at once
+  std::unordered_map<int32_t, int32_t> sym_labels;
+  // for callers that don't bring their own
+  MatchCache cache;
+
+  // determinized matcher, see determinize()
+  // symbols are grouped into classes that the patterns can't distinguish
+  // class 0 is any other character and class 1 any other tag
+  size_t dfa_width = 0;
+  int32_t dfa_ascii[128];
+  std::unordered_map<int32_t, int32_t> dfa_classes;
+  // (state * dfa_width + class) => state, state 0 is dead
+  std::vector<uint32_t> dfa_table;
+  // features of state i are dfa_feats[dfa_final[i]..dfa_final[i+1]]
+  std::vector<uint32_t> dfa_final;
+  std::vector<uint64_t> dfa_feats;
+  uint32_t dfa_start_sl = 0;
+  uint32_t dfa_start_tl = 0;
+
+  void init_symbols();
+  void init_matcher();
+  void match(Reading* reading, bool is_src, sorted_vector<uint64_t>& feats) const;
+  void match_dfa(Reading* reading, bool is_src, sorted_vector<uint64_t>& feats) const;
 public:
   PatternMatcher();
   ~PatternMatcher();
   void get_features(Reading* reading, bool is_src,
-                    sorted_vector<uint64_t>& feats);
+                    sorted_vector<uint64_t>& feats) { get_features(reading, is_src, feats, cache); }
+  // only c is modified, so this can be called concurrently with
+  // different caches
+  void get_features(Reading* reading, bool is_src,
+                    sorted_vector<uint64_t>& feats, MatchCache& c) const;
   void add_pattern(size_t id, const UString& pat);
   void build_trans();
   void read(FILE* input);
   void write(FILE* output);
+  // alphabet and transducer only, for formats that store the
+  // feature states separately
+  void read_fst(FILE* input);
+  void write_fst(FILE* output);
+  // feature states as fixed-width little-endian arrays
+  void write_flat(FILE* output);
+  // use arrays written by write_flat() in place
+  // return the number of bytes used, or 0 if data is malformed
+  size_t view_flat(const char* data, size_t len);
   Alphabet& get_alpha() { return alpha; }
+  // compile the transducer into a dense deterministic table
+  // return false (and keep using the transducer) if that would
+  // need more than max_states states
+  bool determinize(size_t max_states);
+  bool is_determinized() { return !dfa_table.empty(); }
+  MatchCache& get_cache() { return cache; }
+  void set_cache_size(size_t n) { cache.set_size(n); }
+  uint64_t get_cache_hits() { return cache.hits; }
+  uint64_t get_cache_misses() { return cache.misses; }
   std::vector<std::vector<UString>>& get_patterns() { return patterns; }
 };
 
@@ -0,0 +1,136 @@
+#include "profile.h"
+#include <iomanip>
+
+void ProfileData::add(const ProfileData& other)
+{
+  for (int i = 0; i < PROF_STAGES; i++) {
+    wall_ns[i] += other.wall_ns[i];
+    cpu_ns[i] += other.cpu_ns[i];
+  }
+  tokens += other.tokens;
+  ambiguous += other.ambiguous;
+  readings += other.readings;
+  states += other.states;
+  lookups += other.lookups;
+  hits += other.hits;
+  window_feats += other.window_feats;
+}
+
+#ifdef ENABLE_PROFILING
+
+#include <ctime>
+#include <mutex>
+
+bool profiling = false;
+thread_local ProfileData profile_counters;
+
+static std::mutex finished_mutex;
+static ProfileData finished;
+
+static uint64_t now_ns(clockid_t clock)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+namespace {
+
+struct ThreadProfile {
+  ProfileStage stage = PROF_NONE;
+  uint64_t wall_start = 0;
+  uint64_t cpu_start = 0;
+  ~ThreadProfile()
+  {
+    switch_to(PROF_NONE);
+    std::lock_guard<std::mutex> lock(finished_mutex);
+    finished.add(profile_counters);
+  }
+  void switch_to(ProfileStage next)
+  {
+    uint64_t wall = now_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (stage != PROF_NONE) {
+      profile_counters.wall_ns[stage] += wall - wall_start;
+      profile_counters.cpu_ns[stage] += cpu - cpu_start;
+    }
+    stage = next;
+    wall_start = wall;
+    cpu_start = cpu;
+  }
+};
+
+thread_local ThreadProfile thread_profile;
+
+}
+
+ProfileScope::ProfileScope(ProfileStage stage)
+{
+  if (!profiling) {
+    prev = PROF_STAGES;
+    return;
+  }
+  prev = thread_profile.stage;
+  thread_profile.switch_to(stage);
+}
+
+ProfileScope::~ProfileScope()
+{
+  if (prev != PROF_STAGES) thread_profile.switch_to(prev);
+}
+
+void profile_switch(ProfileStage stage)
+{
+  if (profiling) thread_profile.switch_to(stage);
+}
+
+bool profile_enable()
+{
+  profiling = true;
+  return true;
+}
+
+void profile_report(std::ostream& out)
+{
+  ProfileData total;
+  {
+    std::lock_guard<std::mutex> lock(finished_mutex);
+    total = finished;
+  }
+  total.add(profile_counters);
+  static const char* names[PROF_STAGES] = {
+    "", "read", "match", "score", "beam", "output"
+  };
+  out << std::fixed << std::setprecision(3);
+  out << "stage      wall (s)    cpu (s)" << std::endl;
+  for (int i = 1; i < PROF_STAGES; i++) {
+    out << std::left << std::setw(8) << names[i] << std::right
+        << std::setw(11) << (total.wall_ns[i] / 1e9)
+        << std::setw(11) << (total.cpu_ns[i] / 1e9) << std::endl;
+  }
+  out << std::defaultfloat;
+  out << "tokens: " << total.tokens << std::endl;
+  out << "ambiguous tokens: " << total.ambiguous << std::endl;
+  out << "readings: " << total.readings << std::endl;
+  out << "beam states expanded: " << total.states << std::endl;
+  out << "weight lookups: " << total.lookups << std::endl;
+  out << "weight hits: " << total.hits << std::endl;
+  if (total.tokens) {
+    out << "average window features: "
+        << ((double)total.window_feats / (double)total.tokens) << std::endl;
+  }
+}
+
+#else
+
+bool profile_enable()
+{
+  return false;
+}
+
+void profile_report(std::ostream& out)
+{
+  out << "profiling was disabled at compile time" << std::endl;
+}
+
+#endif
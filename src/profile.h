@@ -0,0 +1,75 @@
+#ifndef __SELECTOR_PROFILE_H__
+#define __SELECTOR_PROFILE_H__
+
+#include <cstdint>
+#include <ostream>
+
+// apertium-selector --profile
+// time is charged to the innermost PROFILE_SCOPE on each thread, so
+// stages don't include each other
+// with ENABLE_PROFILING undefined (configure --disable-profiling),
+// the macros compile to nothing
+
+enum ProfileStage {
+  PROF_NONE,
+  PROF_READ,
+  PROF_MATCH,
+  PROF_SCORE,
+  PROF_BEAM,
+  PROF_OUTPUT,
+  PROF_STAGES
+};
+
+struct ProfileData {
+  uint64_t wall_ns[PROF_STAGES] = {};
+  uint64_t cpu_ns[PROF_STAGES] = {};
+  uint64_t tokens = 0;
+  uint64_t ambiguous = 0;
+  uint64_t readings = 0;
+  uint64_t states = 0;
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+  uint64_t window_feats = 0;
+  void add(const ProfileData& other);
+};
+
+#ifdef ENABLE_PROFILING
+
+// timing is off unless profile_enable() is called
+extern bool profiling;
+// this thread's counters, added to the totals when the thread exits
+extern thread_local ProfileData profile_counters;
+
+class ProfileScope {
+private:
+  ProfileStage prev;
+public:
+  ProfileScope(ProfileStage stage);
+  ~ProfileScope();
+};
+
+void profile_switch(ProfileStage stage);
+
+#define PROFILE_CAT2(a, b) a##b
+#define PROFILE_CAT(a, b) PROFILE_CAT2(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CAT(profile_scope_, __LINE__)(stage)
+// charge time to stage until the enclosing PROFILE_SCOPE ends
+#define PROFILE_SWITCH(stage) profile_switch(stage)
+// add n to this thread's counter only with --profile; call it once
+// per function with a local total rather than inside inner loops
+#define PROFILE_COUNT(field, n) do { if (profiling) profile_counters.field += (n); } while (0)
+
+#else
+
+#define PROFILE_SCOPE(stage)
+#define PROFILE_SWITCH(stage) ((void)0)
+#define PROFILE_COUNT(field, n) ((void)sizeof(n))
+
+#endif
+
+// return false if profiling was compiled out
+bool profile_enable();
+// totals from exited threads and the calling thread
+void profile_report(std::ostream& out);
+
+#endif
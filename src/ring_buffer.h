@@ -0,0 +1,48 @@
+#ifndef __SELECTOR_RING_BUFFER_H__
+#define __SELECTOR_RING_BUFFER_H__
+
+#include <cstddef>
+#include <vector>
+
+// FIFO with O(1) push_back, pop_front and random access
+// capacity is a power of 2 and only grows if a push would overflow it,
+// so a buffer that is reserved to the right size never allocates
+template<typename T>
+class RingBuffer {
+private:
+  std::vector<T> elements;
+  size_t start = 0;
+  size_t count = 0;
+public:
+  void reserve(size_t n)
+  {
+    if (n <= elements.size()) return;
+    size_t cap = (elements.empty() ? 4 : elements.size());
+    while (cap < n) cap *= 2;
+    std::vector<T> temp(cap);
+    for (size_t i = 0; i < count; i++) temp[i] = (*this)[i];
+    elements.swap(temp);
+    start = 0;
+  }
+  void push_back(const T& t)
+  {
+    if (count == elements.size()) reserve(count + 1);
+    elements[(start + count) & (elements.size() - 1)] = t;
+    count++;
+  }
+  T pop_front()
+  {
+    T ret = elements[start];
+    start = (start + 1) & (elements.size() - 1);
+    count--;
+    return ret;
+  }
+  T& operator[](size_t i) { return elements[(start + i) & (elements.size() - 1)]; }
+  T& front() { return (*this)[0]; }
+  T& back() { return (*this)[count - 1]; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  void clear() { start = 0; count = 0; }
+};
+
+#endif
@@ -1,36 +1,114 @@
 #include "selector.h"
+#include "profile.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// a run of LUs decoded independently by process_parallel()
+struct SelectorChunk {
+  // copies of the preceding LUs, with their selected readings
+  std::vector<LU*> context;
+  std::vector<size_t> context_selected;
+  // the LUs to decode, followed by copies of the lookahead
+  std::vector<LU*> lus;
+  size_t count = 0;
+  // true if the chunk ends with the EOF LU rather than at a safe point
+  bool eof_end = false;
+  std::vector<size_t> selected;
+  bool done = false;
+};
 
 Selector::Selector()
+  : fs(new FeatureSet()), owns_fs(true)
+{
+  reset();
+}
+
+Selector::Selector(FeatureSet* shared)
+  : fs(shared), owns_fs(false)
 {
+  init_window();
   reset();
 }
 
 Selector::~Selector()
 {
   reset();
+  for (auto& it : lu_pool) delete it;
+  if (owns_fs) delete fs;
+}
+
+void Selector::init_window()
+{
+  lookbehind = fs->get_lookbehind();
+  pos_window = lookbehind + 1 + fs->get_lookahead();
+  prev.reserve(lookbehind + 1);
+  prev_selected.reserve(lookbehind + 1);
+  queue.reserve(pos_window);
+  window.reserve(pos_window);
+}
+
+void Selector::copy_settings(const Selector& other)
+{
+  chunk_size = other.chunk_size;
+  max_uncommitted = other.max_uncommitted;
+  max_hypotheses = other.max_hypotheses;
+  match_cache.set_size(other.match_cache.max_entries);
+  reference_scoring = other.reference_scoring;
 }
 
 void Selector::load(FILE* input)
 {
-  fs.load(input);
-  lookbehind = fs.get_lookbehind();
-  pos_window = lookbehind + 1 + fs.get_lookahead();
+  fs->load(input);
+  init_window();
 }
 
 void Selector::reset()
 {
-  for (auto& it : prev) delete it;
-  prev.clear();
-  for (auto& it : queue) delete it;
-  queue.clear();
-  path.clear();
-  std::vector<BeamSearchState> temp;
-  temp.push_back(std::make_pair(0.0, std::make_pair(0, 0)));
-  path.push_back(temp);
+  while (!prev.empty()) free_lu(prev.pop_front());
+  while (!queue.empty()) free_lu(queue.pop_front());
+  prev_selected.clear();
+  reset_path();
   cur_word = 0;
 }
 
+void Selector::reset_path()
+{
+  // one state per LU in prev, holding the reading that was selected
+  size_t len = prev.size() + 1;
+  while (path.size() < len) path.push_back(std::vector<BeamSearchState>());
+  path[0].assign(1, std::make_pair(0.0, std::make_pair(0, 0)));
+  for (size_t i = 1; i < len; i++) {
+    path[i].assign(1, std::make_pair(0.0, std::make_pair(prev_selected[i-1], 0)));
+  }
+  path_len = len;
+}
+
+void Selector::push_path(const sorted_vector<BeamSearchState>& states)
+{
+  if (path_len == path.size()) path.push_back(std::vector<BeamSearchState>());
+  path[path_len].assign(states.begin(), states.end());
+  path_len++;
+}
+
+LU* Selector::new_lu()
+{
+  if (lu_pool.empty()) return new LU();
+  LU* ret = lu_pool.back();
+  lu_pool.pop_back();
+  return ret;
+}
+
+void Selector::free_lu(LU* lu)
+{
+  lu->clear();
+  lu_pool.push_back(lu);
+}
+
 LU* Selector::get_lu(size_t pos)
 {
   int idx = (int)(cur_word + pos) - (int)lookbehind;
@@ -47,12 +125,22 @@ LU* Selector::get_lu(size_t pos)
   return nullptr;
 }
 
-void Selector::refill_queue(InputFile& input)
+void Selector::refill_queue(StreamReader* input)
 {
   if (at_eof) return;
   if (!queue.empty() && queue.back()->isEOF()) return;
-  while (queue.size() < cur_word + fs.get_lookahead()) {
-    LU* l = fs.read_lu(input);
+  while (queue.size() < cur_word + fs->get_lookahead()) {
+    LU* l;
+    if (source != nullptr) {
+      if (source_pos == source->size()) {
+        at_eof = true;
+        return;
+      }
+      l = (*source)[source_pos++];
+    } else {
+      l = new_lu();
+      fs->read_lu(*input, l, match_cache);
+    }
     queue.push_back(l);
     if (l->isEOF()) {
       at_eof = true;
@@ -72,26 +160,45 @@ void Selector::add_feats(sorted_vector<FeatLoc>& feats, size_t loc,
   rd->get_feats((int)loc - (int)lookbehind, feats);
 }
 
-void Selector::get_path_feats(sorted_vector<FeatLoc>& feats,
-                              size_t ridx, size_t sidx)
+void Selector::get_history_feats(sorted_vector<FeatLoc>& feats, size_t sidx)
 {
-  add_feats(feats, lookbehind, queue[cur_word], ridx);
   size_t path_pos = sidx;
   for (size_t loc = 0; loc < lookbehind; loc++) {
-    if (loc == path.size()) break;
+    if (loc == path_len) break;
     LU* lu = get_lu(lookbehind-loc-1);
     if (lu == nullptr) break;
-    auto& state = path[path.size()-loc-1][path_pos];
+    auto& state = path[path_len-loc-1][path_pos];
     path_pos = state.second.second;
     add_feats(feats, lookbehind-loc-1, lu, state.second.first);
   }
 }
 
-void Selector::process_next_word(UFILE* output)
+// the sum of the weights in parts, which are each sorted and share
+// no pairs, added in (first, second) order as get_weight() would
+static double sum_in_order(const std::vector<WeightedPair>** parts, size_t n)
 {
-  std::vector<LU*> window;
-  window.reserve(pos_window);
-  sorted_vector<FeatLoc> context_feats;
+  size_t pos[4] = {0, 0, 0, 0};
+  double ret = 0.0;
+  while (true) {
+    size_t best = n;
+    for (size_t k = 0; k < n; k++) {
+      if (pos[k] == parts[k]->size()) continue;
+      if (best == n || (*parts[k])[pos[k]].first < (*parts[best])[pos[best]].first) {
+        best = k;
+      }
+    }
+    if (best == n) break;
+    ret += (*parts[best])[pos[best]++].second;
+  }
+  return ret;
+}
+
+void Selector::process_next_word(StreamWriter* output)
+{
+  PROFILE_SCOPE(PROF_SCORE);
+  token_count++;
+  window.clear();
+  context_feats.clear();
   for (size_t i = 0; i < pos_window; i++) {
     LU* lu = get_lu(i);
     window.push_back(lu);
@@ -100,70 +207,432 @@ void Selector::process_next_word(UFILE* output)
     }
   }
   LU* cur = window[lookbehind];
+  PROFILE_COUNT(tokens, 1);
+  PROFILE_COUNT(ambiguous, cur->ambiguous() ? 1u : 0u);
+  PROFILE_COUNT(readings, cur->get_trg().size());
+  PROFILE_COUNT(window_feats, context_feats.size());
 
-  sorted_vector<BeamSearchState> next_path;
+  // The weight of a hypothesis is the sum over all pairs in
+  // context + reading + history, but the context pairs are the same
+  // for every hypothesis and the reading and history pairs only
+  // depend on one index each, so only reading x history is
+  // looked up per hypothesis.
+  // Features already in the context are removed from the other
+  // sets so that each pair is still only counted once.
+  // The matches are then added up in the order that get_weight()
+  // would use for the merged set, so the scores are exactly the same.
   size_t ridx_lim = (cur->get_trg().size() ? cur->get_trg().size() : 1);
-  for (size_t ridx = 0; ridx < ridx_lim; ridx++) {
-    for (size_t sidx = 0; sidx < path.back().size(); sidx++) {
-      sorted_vector<FeatLoc> feats = context_feats;
-      get_path_feats(feats, ridx, sidx);
-      BeamSearchState next;
-      // make it negative to sort
-      next.first = path.back()[sidx].first - fs.get_weight(feats);
-      next.second.first = ridx;
-      next.second.second = sidx;
-      next_path.insert(next);
-    }
-  }
-  if (fs.get_beam_size()) {
-    while (next_path.size() > fs.get_beam_size()) {
+  auto& last_states = path[path_len-1];
+  size_t sidx_lim = last_states.size();
+  next_path.clear();
+  if (reference_scoring) {
+    for (size_t ridx = 0; ridx < ridx_lim; ridx++) {
+      for (size_t sidx = 0; sidx < sidx_lim; sidx++) {
+        scratch_feats = context_feats;
+        add_feats(scratch_feats, lookbehind, cur, ridx);
+        get_history_feats(scratch_feats, sidx);
+        BeamSearchState next;
+        next.first = last_states[sidx].first - fs->get_weight(scratch_feats);
+        next.second.first = ridx;
+        next.second.second = sidx;
+        next_path.insert(next);
+      }
+    }
+  } else {
+    context_matches.clear();
+    fs->get_matches(context_feats, context_matches);
+    if (reading_feats.size() < ridx_lim) {
+      reading_feats.resize(ridx_lim);
+      reading_matches.resize(ridx_lim);
+    }
+    for (size_t ridx = 0; ridx < ridx_lim; ridx++) {
+      scratch_feats.clear();
+      reading_feats[ridx].clear();
+      reading_matches[ridx].clear();
+      add_feats(scratch_feats, lookbehind, cur, ridx);
+      for (auto& f : scratch_feats) {
+        if (!context_feats.count(f)) reading_feats[ridx].insert(f);
+      }
+      fs->get_matches(context_feats, reading_feats[ridx], reading_matches[ridx]);
+      size_t mid = reading_matches[ridx].size();
+      fs->get_matches(reading_feats[ridx], reading_matches[ridx]);
+      std::inplace_merge(reading_matches[ridx].begin(),
+                         reading_matches[ridx].begin() + (long)mid,
+                         reading_matches[ridx].end());
+    }
+    if (history_feats.size() < sidx_lim) {
+      history_feats.resize(sidx_lim);
+      history_matches.resize(sidx_lim);
+    }
+    for (size_t sidx = 0; sidx < sidx_lim; sidx++) {
+      scratch_feats.clear();
+      history_feats[sidx].clear();
+      history_matches[sidx].clear();
+      get_history_feats(scratch_feats, sidx);
+      for (auto& f : scratch_feats) {
+        if (!context_feats.count(f)) history_feats[sidx].insert(f);
+      }
+      fs->get_matches(context_feats, history_feats[sidx], history_matches[sidx]);
+      size_t mid = history_matches[sidx].size();
+      fs->get_matches(history_feats[sidx], history_matches[sidx]);
+      std::inplace_merge(history_matches[sidx].begin(),
+                         history_matches[sidx].begin() + (long)mid,
+                         history_matches[sidx].end());
+    }
+
+    for (size_t ridx = 0; ridx < ridx_lim; ridx++) {
+      for (size_t sidx = 0; sidx < sidx_lim; sidx++) {
+        cross_matches.clear();
+        fs->get_matches(reading_feats[ridx], history_feats[sidx], cross_matches);
+        const std::vector<WeightedPair>* parts[4] = {
+          &context_matches, &reading_matches[ridx],
+          &history_matches[sidx], &cross_matches};
+        BeamSearchState next;
+        // make it negative to sort
+        next.first = last_states[sidx].first - sum_in_order(parts, 4);
+        next.second.first = ridx;
+        next.second.second = sidx;
+        next_path.insert(next);
+      }
+    }
+  }
+  PROFILE_COUNT(states, ridx_lim * sidx_lim);
+  PROFILE_SWITCH(PROF_BEAM);
+  size_t beam = fs->get_beam_size();
+  if (max_hypotheses && (beam == 0 || beam > max_hypotheses)) {
+    beam = max_hypotheses;
+  }
+  if (beam) {
+    while (next_path.size() > beam) {
       next_path.erase(next_path.back());
     }
   }
-  path.push_back(next_path.get());
+  push_path(next_path);
 
-  if (cur->ambiguous()) {
+  // the best state is first, so committing from state 0 of an ambiguous
+  // word commits the best-scoring path so far
+  bool force = (cur->ambiguous() && max_uncommitted &&
+                cur_word + 1 >= max_uncommitted);
+  if (cur->ambiguous() && !force) {
     cur_word++;
   } else {
-    std::vector<size_t> selected;
-    selected.resize(cur_word+1, 0);
+    if (force) forced_commits++;
+    selected.assign(cur_word+1, 0);
     size_t path_pos = 0;
     for (size_t i = 0; i <= cur_word; i++) {
-      auto& state = path[path.size()-i-1][path_pos];
+      auto& state = path[path_len-i-1][path_pos];
       selected[selected.size()-i-1] = state.second.first;
       path_pos = state.second.second;
     }
     for (size_t i = 0; i < selected.size(); i++) {
-      queue[i]->write(output, selected[i]);
-      queue[i]->keep_only(selected[i]);
-      prev.push_back(queue[i]);
+      LU* lu = queue.pop_front();
+      if (record != nullptr) {
+        record->push_back(selected[i]);
+      } else {
+        PROFILE_SWITCH(PROF_OUTPUT);
+        lu->write(*output, selected[i]);
+        PROFILE_SWITCH(PROF_BEAM);
+        lu->keep_only(selected[i]);
+      }
+      prev.push_back(lu);
+      prev_selected.push_back(selected[i]);
     }
-    queue.erase(queue.begin(), queue.begin()+selected.size());
     while (prev.size() > lookbehind) {
-      delete prev[0];
-      prev.erase(prev.begin());
+      LU* lu = prev.pop_front();
+      prev_selected.pop_front();
+      if (source == nullptr) free_lu(lu);
     }
-    BeamSearchState empty_state = std::make_pair(0.0, std::make_pair(0, 0));
-    std::vector<BeamSearchState> empty_vec(1, empty_state);
-    path.clear();
-    path.resize(prev.size()+1, empty_vec);
+    reset_path();
     cur_word = 0;
   }
 }
 
-void Selector::process(InputFile& input, UFILE* output)
+void Selector::process(StreamReader& input, StreamWriter& output, size_t threads)
 {
-  while (!input.eof()) {
+  if (threads > 1) {
+    process_parallel(input, output, threads);
+    PROFILE_SCOPE(PROF_OUTPUT);
+    output.flush();
+    return;
+  }
+  // stop once output fails, e.g. when the reader has gone away
+  while (!input.eof() && output.good()) {
     at_eof = false;
-    refill_queue(input);
+    refill_queue(&input);
+    while (!queue.empty() && output.good()) {
+      process_next_word(&output);
+      refill_queue(&input);
+    }
+    if (input.peek() == '\0') {
+      input.get();
+      PROFILE_SCOPE(PROF_OUTPUT);
+      output.put('\0');
+      output.flush();
+    }
+  }
+  PROFILE_SCOPE(PROF_OUTPUT);
+  output.flush();
+}
+
+void Selector::decode_chunk(SelectorChunk& chunk)
+{
+  prev.clear();
+  prev_selected.clear();
+  queue.clear();
+  for (size_t i = 0; i < chunk.context.size(); i++) {
+    prev.push_back(chunk.context[i]);
+    prev_selected.push_back(chunk.context_selected[i]);
+  }
+  reset_path();
+  cur_word = 0;
+  at_eof = false;
+  source = &chunk.lus;
+  source_pos = 0;
+  record = &chunk.selected;
+  chunk.selected.clear();
+  refill_queue(nullptr);
+  while (chunk.selected.size() < chunk.count && !queue.empty()) {
+    process_next_word(nullptr);
+    refill_queue(nullptr);
+  }
+  prev.clear();
+  prev_selected.clear();
+  queue.clear();
+  source = nullptr;
+  record = nullptr;
+}
+
+// Decoding only looks back across a committed word through the
+// history in prev, so if the last max(lookbehind, 1) words read are
+// unambiguous, every hypothesis agrees on them and the words after
+// them can be decoded without waiting for the words before.
+// The main thread reads the input (the pattern cache isn't shared
+// safely) and cuts it at such points into chunks, each of which
+// carries copies of its lookbehind context and lookahead.
+// If a chunk reaches max_size without such a point, the main thread
+// decodes it itself up to the next commit, after which the selected
+// readings are known and can be the context of the next chunk.
+void Selector::process_parallel(StreamReader& input, StreamWriter& output, size_t threads)
+{
+  size_t lookahead = fs->get_lookahead();
+  size_t min_run = std::max(lookbehind, (size_t)1);
+  size_t min_size = std::max(chunk_size, lookahead + 1);
+  size_t max_size = (max_uncommitted ? std::max(min_size, max_uncommitted)
+                                     : 16 * min_size);
+
+  std::mutex mtx;
+  std::condition_variable work_cv, done_cv;
+  std::deque<SelectorChunk*> jobs;
+  std::deque<SelectorChunk*> pending;
+  bool stop = false;
+  std::vector<std::unique_ptr<Selector>> decoders;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    decoders.emplace_back(new Selector(fs));
+    Selector* sel = decoders.back().get();
+    sel->copy_settings(*this);
+    workers.emplace_back([&, sel]() {
+      while (true) {
+        SelectorChunk* c;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          work_cv.wait(lock, [&]() { return stop || !jobs.empty(); });
+          if (jobs.empty()) return;
+          c = jobs.front();
+          jobs.pop_front();
+        }
+        sel->decode_chunk(*c);
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          c->done = true;
+        }
+        done_cv.notify_all();
+      }
+    });
+  }
+
+  // copies of the last lookbehind words, with their selected readings
+  std::deque<std::pair<LU*, size_t>> history;
+  auto remember = [&](LU* lu, size_t sel) {
+    LU* copy = new_lu();
+    copy->assign(*lu);
+    history.push_back(std::make_pair(copy, sel));
+    while (history.size() > lookbehind) {
+      free_lu(history.front().first);
+      history.pop_front();
+    }
+  };
+  auto new_chunk = [&]() {
+    SelectorChunk* c = new SelectorChunk();
+    for (auto& it : history) {
+      LU* copy = new_lu();
+      copy->assign(*it.first);
+      c->context.push_back(copy);
+      c->context_selected.push_back(it.second);
+    }
+    return c;
+  };
+  auto submit = [&](SelectorChunk* c) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      jobs.push_back(c);
+      pending.push_back(c);
+    }
+    work_cv.notify_one();
+  };
+  // write finished chunks in order, waiting for all of them if all is
+  // set, or until no more than 2 per thread are in flight otherwise
+  auto write_done = [&](bool all) {
+    while (!pending.empty()) {
+      SelectorChunk* c = pending.front();
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!c->done) {
+          if (!all && pending.size() <= 2*threads) return;
+          done_cv.wait(lock, [&]() { return c->done; });
+        }
+      }
+      pending.pop_front();
+      {
+        PROFILE_SCOPE(PROF_OUTPUT);
+        for (size_t i = 0; i < c->count; i++) {
+          c->lus[i]->write(output, c->selected[i]);
+        }
+      }
+      if (c->eof_end) {
+        size_t i = (c->count > lookbehind ? c->count - lookbehind : 0);
+        for (; i < c->count; i++) remember(c->lus[i], c->selected[i]);
+      }
+      for (auto& lu : c->context) free_lu(lu);
+      for (auto& lu : c->lus) free_lu(lu);
+      delete c;
+    }
+  };
+
+  size_t run = 0;
+  // decode c and any further input on this thread, once everything
+  // before it has been written, until a commit leaves only lookahead
+  // in the queue, which starts the returned chunk (null at the end
+  // of the input)
+  auto decode_until_commit = [&](SelectorChunk* c) {
+    for (auto& it : history) {
+      prev.push_back(it.first);
+      prev_selected.push_back(it.second);
+    }
+    history.clear();
+    for (auto& lu : c->context) free_lu(lu);
+    for (auto& lu : c->lus) queue.push_back(lu);
+    // counted again by process_next_word()
+    token_count -= c->lus.size();
+    delete c;
+    reset_path();
+    cur_word = 0;
+    at_eof = false;
+    do {
+      process_next_word(&output);
+      refill_queue(&input);
+    } while (!queue.empty() && (cur_word != 0 || queue.size() > lookahead));
+    for (size_t i = 0; i < prev.size(); i++) remember(prev[i], prev_selected[i]);
+    while (!prev.empty()) free_lu(prev.pop_front());
+    prev_selected.clear();
+    reset_path();
+    sequential_fallbacks++;
+    run = 0;
+    if (queue.empty()) return (SelectorChunk*)nullptr;
+    c = new_chunk();
     while (!queue.empty()) {
-      process_next_word(output);
-      refill_queue(input);
+      LU* lu = queue.pop_front();
+      c->lus.push_back(lu);
+      token_count++;
+      run = (lu->ambiguous() ? 0 : run + 1);
+    }
+    if (c->lus.back()->isEOF()) {
+      c->count = c->lus.size();
+      c->eof_end = true;
+      submit(c);
+      return (SelectorChunk*)nullptr;
+    }
+    return c;
+  };
+
+  while (!input.eof() && output.good()) {
+    SelectorChunk* cur = new_chunk();
+    size_t cut = 0;
+    while (cur != nullptr) {
+      LU* lu = new_lu();
+      fs->read_lu(input, lu, match_cache);
+      cur->lus.push_back(lu);
+      bool eof = lu->isEOF();
+      token_count++;
+      run = (lu->ambiguous() ? 0 : run + 1);
+      if (cut == 0 && (eof || (cur->lus.size() >= min_size && run >= min_run))) {
+        cut = cur->lus.size();
+      }
+      if (cut == 0 && cur->lus.size() >= max_size) {
+        write_done(true);
+        cur = decode_until_commit(cur);
+        cut = 0;
+        continue;
+      }
+      if (cut == 0 || (!eof && cur->lus.size() < cut + lookahead)) continue;
+
+      // everything after cut is lookahead, which moves to the next chunk
+      // and is left behind as copies
+      cur->count = cut;
+      cur->eof_end = (cut == cur->lus.size() && eof);
+      if (!cur->eof_end) {
+        for (size_t i = (cut > lookbehind ? cut - lookbehind : 0); i < cut; i++) {
+          remember(cur->lus[i], 0);
+        }
+      }
+      SelectorChunk* next = nullptr;
+      if (cut < cur->lus.size()) {
+        next = new_chunk();
+        for (size_t i = cut; i < cur->lus.size(); i++) {
+          next->lus.push_back(cur->lus[i]);
+          LU* copy = new_lu();
+          copy->assign(*cur->lus[i]);
+          cur->lus[i] = copy;
+        }
+        if (eof) {
+          next->count = next->lus.size();
+          next->eof_end = true;
+        }
+      }
+      submit(cur);
+      write_done(false);
+      cur = next;
+      cut = 0;
+      if (cur != nullptr && cur->eof_end) {
+        submit(cur);
+        cur = nullptr;
+      }
     }
+    write_done(true);
+    run = 0;
     if (input.peek() == '\0') {
       input.get();
-      u_fputc('\0', output);
-      u_fflush(output);
+      PROFILE_SCOPE(PROF_OUTPUT);
+      output.put('\0');
+      output.flush();
     }
   }
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stop = true;
+  }
+  work_cv.notify_all();
+  for (auto& w : workers) w.join();
+  for (auto& d : decoders) forced_commits += d->forced_commits;
+  for (auto& it : history) free_lu(it.first);
+}
+
+void Selector::print_stats(std::ostream& out)
+{
+  out << "tokens: " << token_count << std::endl;
+  out << "feature cache hits: " << match_cache.hits << std::endl;
+  out << "feature cache misses: " << match_cache.misses << std::endl;
+  out << "forced commits: " << forced_commits << std::endl;
+  out << "chunks decoded sequentially: " << sequential_fallbacks << std::endl;
 }
@@ -2,16 +2,30 @@
 #define __SELECTOR_PROC_H__
 
 #include "feature_set.h"
+#include "ring_buffer.h"
+#include <ostream>
 
 // (-weight of path, (selected reading, prev state))
 typedef std::pair<double, std::pair<size_t, size_t>> BeamSearchState;
 
+struct SelectorChunk;
+
 class Selector {
 private:
-  std::vector<LU*> prev;
-  std::vector<LU*> queue;
+  RingBuffer<LU*> prev;
+  // the reading that was selected for each LU in prev
+  RingBuffer<size_t> prev_selected;
+  RingBuffer<LU*> queue;
+  // cleared LUs, reused by refill_queue()
+  std::vector<LU*> lu_pool;
+  // path[0..path_len], the vectors beyond path_len are kept
+  // so that their capacity can be reused
   std::vector<std::vector<BeamSearchState>> path;
-  FeatureSet fs;
+  size_t path_len = 0;
+  FeatureSet* fs = nullptr;
+  bool owns_fs = true;
+  // pattern matches for the LUs this session reads
+  MatchCache match_cache;
   size_t cur_word = 0;
 
   // numbers we reference a lot - copied/calculated from fs
@@ -20,17 +34,76 @@ private:
 
   bool at_eof = false;
 
+  // when decoding a chunk for process() with multiple threads,
+  // LUs come from source and are not modified or freed,
+  // and selections are appended to record instead of being written
+  std::vector<LU*>* source = nullptr;
+  size_t source_pos = 0;
+  std::vector<size_t>* record = nullptr;
+  // minimum number of LUs in a chunk
+  size_t chunk_size = 1000;
+
+  // if non-zero, commit the best path once this many words are
+  // uncommitted, even if the current word is ambiguous
+  size_t max_uncommitted = 0;
+  // if non-zero, keep at most this many states per word,
+  // in addition to the beam size from the model
+  size_t max_hypotheses = 0;
+  uint64_t forced_commits = 0;
+  // chunks that grew too long and were decoded by the reading thread
+  uint64_t sequential_fallbacks = 0;
+
+  // scratch space for process_next_word(), kept between words
+  std::vector<LU*> window;
+  sorted_vector<FeatLoc> context_feats;
+  sorted_vector<FeatLoc> scratch_feats;
+  std::vector<sorted_vector<FeatLoc>> reading_feats;
+  std::vector<sorted_vector<FeatLoc>> history_feats;
+  std::vector<WeightedPair> context_matches;
+  std::vector<std::vector<WeightedPair>> reading_matches;
+  std::vector<std::vector<WeightedPair>> history_matches;
+  std::vector<WeightedPair> cross_matches;
+  // score each hypothesis by looking up every pair in its merged
+  // window, as before the scores were split up (for checking)
+  bool reference_scoring = false;
+  sorted_vector<BeamSearchState> next_path;
+  std::vector<size_t> selected;
+
+  uint64_t token_count = 0;
+
+  void init_window();
   void reset();
-  void refill_queue(InputFile& input);
-  void process_next_word(UFILE* output);
+  void reset_path();
+  void push_path(const sorted_vector<BeamSearchState>& states);
+  LU* new_lu();
+  void free_lu(LU* lu);
+  void refill_queue(StreamReader* input);
+  void process_next_word(StreamWriter* output);
   LU* get_lu(size_t pos);
   void add_feats(sorted_vector<FeatLoc>& feats, size_t loc, LU* rd, size_t ridx);
-  void get_path_feats(sorted_vector<FeatLoc>& feats, size_t ridx, size_t sidx);
+  void get_history_feats(sorted_vector<FeatLoc>& feats, size_t sidx);
+  void decode_chunk(SelectorChunk& chunk);
+  void process_parallel(StreamReader& input, StreamWriter& output, size_t threads);
 public:
   Selector();
+  // share another Selector's (loaded) weights, which must outlive this
+  Selector(FeatureSet* shared);
   ~Selector();
   void load(FILE* input);
-  void process(InputFile& input, UFILE* output);
+  // with threads > 1, the input is split into chunks at points where
+  // decoding cannot depend on earlier choices, which are decoded
+  // in parallel and written in order
+  void process(StreamReader& input, StreamWriter& output, size_t threads = 1);
+  bool determinize(size_t max_states) { return fs->determinize(max_states); }
+  void set_cache_size(size_t n) { match_cache.set_size(n); }
+  void set_max_uncommitted(size_t n) { max_uncommitted = n; }
+  void set_max_hypotheses(size_t n) { max_hypotheses = n; }
+  void set_reference_scoring(bool b) { reference_scoring = b; }
+  FeatureSet* get_feature_set() { return fs; }
+  // copy decoding options (not the model or state) from other
+  void copy_settings(const Selector& other);
+  uint64_t get_token_count() { return token_count; }
+  void print_stats(std::ostream& out);
 };
 
 #endif
@@ -0,0 +1,126 @@
+#include "selector_server.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+// written to by the signal handler to wake up run()
+static int stop_pipe[2] = {-1, -1};
+
+static void request_stop(int)
+{
+  int saved = errno;
+  if (write(stop_pipe[1], "", 1) == -1) {}
+  errno = saved;
+}
+
+SelectorServer::SelectorServer(Selector& model, const std::string& path)
+  : model(model), path(path)
+{}
+
+SelectorServer::~SelectorServer()
+{
+  if (listen_fd != -1) {
+    close(listen_fd);
+    unlink(path.c_str());
+  }
+}
+
+void SelectorServer::serve_client(int fd)
+{
+  {
+    StreamReader input;
+    input.wrap(fd);
+    StreamWriter output;
+    output.wrap(fd);
+    Selector session(model.get_feature_set());
+    session.copy_settings(model);
+    try {
+      session.process(input, output);
+    } catch (std::exception& e) {
+      std::cerr << "apertium-selector: client error: " << e.what() << std::endl;
+    }
+  }
+  // forget fd before closing it, as accept() may reuse the number
+  {
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    clients.erase(fd);
+    clients_done.notify_all();
+  }
+  close(fd);
+}
+
+void SelectorServer::run()
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("socket path too long: " + path);
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  // a client hanging up mid-response shouldn't kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (stop_pipe[0] == -1) {
+    if (pipe(stop_pipe) == -1) {
+      throw std::runtime_error(std::string("pipe: ") + strerror(errno));
+    }
+    fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stop;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGINT, &sa, nullptr);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  }
+  unlink(path.c_str());
+  if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+    throw std::runtime_error("unable to bind " + path + ": " + strerror(errno));
+  }
+  if (listen(listen_fd, SOMAXCONN) == -1) {
+    throw std::runtime_error(std::string("listen: ") + strerror(errno));
+  }
+  pollfd fds[2];
+  fds[0].fd = listen_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_pipe[0];
+  fds[1].events = POLLIN;
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error(std::string("poll: ") + strerror(errno));
+    }
+    if (fds[1].revents) break;
+    if (!fds[0].revents) continue;
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      throw std::runtime_error(std::string("accept: ") + strerror(errno));
+    }
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    clients.insert(fd);
+    std::thread(&SelectorServer::serve_client, this, fd).detach();
+  }
+
+  // stop accepting, then let each session finish what it has read
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(path.c_str());
+  std::unique_lock<std::mutex> lock(clients_mutex);
+  for (auto fd : clients) shutdown(fd, SHUT_RD);
+  clients_done.wait(lock, [this] { return clients.empty(); });
+}
@@ -0,0 +1,33 @@
+#ifndef __SELECTOR_SERVER_H__
+#define __SELECTOR_SERVER_H__
+
+#include "selector.h"
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+
+// serve a loaded Selector's model on a Unix domain socket
+// each connection is a stream like apertium-selector's stdin/stdout,
+// decoded by its own Selector session in its own thread, and the
+// output is flushed after each \0
+// run() returns on SIGTERM or SIGINT, after the open connections have
+// been told there is no more input and have finished, and the socket
+// file is removed when the server is destroyed
+class SelectorServer {
+private:
+  Selector& model;
+  std::string path;
+  int listen_fd = -1;
+  // descriptors of the connections being served
+  std::set<int> clients;
+  std::mutex clients_mutex;
+  std::condition_variable clients_done;
+  void serve_client(int fd);
+public:
+  SelectorServer(Selector& model, const std::string& path);
+  ~SelectorServer();
+  void run();
+};
+
+#endif
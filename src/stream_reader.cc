@@ -0,0 +1,238 @@
+#include "stream_reader.h"
+#include "profile.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+#include <unicode/utf8.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// bytes that can end a run of ordinary text in a blank or reading
+static const char SPECIAL[] = {'^', '/', '$', '<', '>', '\\', '\0', '[', ']'};
+
+static bool is_special(unsigned char c)
+{
+  static bool table[256] = {};
+  static bool init = [](){
+    for (auto& c : SPECIAL) table[(unsigned char)c] = true;
+    return true;
+  }();
+  (void)init;
+  return table[c];
+}
+
+StreamReader::StreamReader(size_t buffer_size)
+  : buffer(buffer_size)
+{}
+
+StreamReader::~StreamReader()
+{
+  if (owns_fd) close(fd);
+}
+
+bool StreamReader::open(const char* fname)
+{
+  if (owns_fd) close(fd);
+  owns_fd = false;
+  fd = 0;
+  pos = end = 0;
+  if (fname == nullptr || *fname == '\0') return true;
+  fd = ::open(fname, O_RDONLY);
+  if (fd == -1) {
+    fd = 0;
+    return false;
+  }
+  owns_fd = true;
+  return true;
+}
+
+void StreamReader::open_or_exit(const char* fname)
+{
+  if (!open(fname)) {
+    std::cerr << "Error: Unable to open '" << fname << "' for reading." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void StreamReader::wrap(int new_fd)
+{
+  if (owns_fd) close(fd);
+  owns_fd = false;
+  fd = new_fd;
+  pos = end = 0;
+}
+
+size_t StreamReader::fill()
+{
+  if (pos < end) return end - pos;
+  pos = end = 0;
+  while (true) {
+    ssize_t n = ::read(fd, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n > 0) end = (size_t)n;
+    return end;
+  }
+}
+
+size_t StreamReader::scan(size_t from) const
+{
+  const char* buf = buffer.data();
+  size_t i = from;
+#ifdef __SSE2__
+  __m128i sp[sizeof(SPECIAL)];
+  for (size_t k = 0; k < sizeof(SPECIAL); k++) sp[k] = _mm_set1_epi8(SPECIAL[k]);
+  for (; i + 16 <= end; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+    __m128i hit = _mm_cmpeq_epi8(block, sp[0]);
+    for (size_t k = 1; k < sizeof(SPECIAL); k++) {
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, sp[k]));
+    }
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+#endif
+  for (; i < end; i++) {
+    if (is_special((unsigned char)buf[i])) return i;
+  }
+  return end;
+}
+
+bool StreamReader::eof()
+{
+  return fill() == 0;
+}
+
+int StreamReader::peek()
+{
+  if (fill() == 0) return -1;
+  return (unsigned char)buffer[pos];
+}
+
+int StreamReader::get()
+{
+  if (fill() == 0) return -1;
+  return (unsigned char)buffer[pos++];
+}
+
+void StreamReader::read_char(std::string& out)
+{
+  int c = get();
+  if (c == -1) return;
+  out += (char)c;
+  size_t len = (size_t)U8_COUNT_TRAIL_BYTES(c) + 1;
+  for (size_t i = 1; i < len && peek() != -1; i++) {
+    if (!U8_IS_TRAIL(peek())) break;
+    out += (char)get();
+  }
+}
+
+void StreamReader::read_block(std::string& out, char end_c)
+{
+  while (fill()) {
+    const char* buf = buffer.data();
+    size_t i = scan(pos);
+    out.append(buf + pos, i - pos);
+    pos = i;
+    if (pos == end) continue;
+    char c = buf[pos++];
+    out += c;
+    if (c == '\\') read_char(out);
+    else if (c == end_c) return;
+  }
+}
+
+void StreamReader::read_blank(std::string& blank)
+{
+  while (fill()) {
+    const char* buf = buffer.data();
+    size_t i = scan(pos);
+    blank.append(buf + pos, i - pos);
+    pos = i;
+    if (pos == end) continue;
+    char c = buf[pos];
+    if (c == '^' || c == '\0') return;
+    pos++;
+    blank += c;
+    if (c == '\\') read_char(blank);
+    // superblanks can contain any of the other special characters
+    else if (c == '[') read_block(blank, ']');
+  }
+}
+
+void StreamReader::decode_symbols(Reading* r, size_t from)
+{
+  const uint8_t* raw = reinterpret_cast<const uint8_t*>(r->raw.data());
+  auto& symbols = r->symbols;
+  int32_t len = (int32_t)r->raw.size();
+  int32_t i = (int32_t)from;
+  while (i < len) {
+    uint8_t b = raw[i];
+    if (b < 0x80) {
+      symbols.push_back(b);
+      i++;
+      continue;
+    }
+    UChar32 c;
+    U8_NEXT(raw, i, len, c);
+    symbols.push_back(c < 0 ? 0xFFFD : c);
+  }
+}
+
+void StreamReader::read_reading(Reading* r, const Alphabet& alpha)
+{
+  std::string& raw = r->raw;
+  size_t decoded = raw.size();
+  while (fill()) {
+    const char* buf = buffer.data();
+    size_t i = scan(pos);
+    raw.append(buf + pos, i - pos);
+    pos = i;
+    if (pos == end) continue;
+    char c = buf[pos];
+    if (c == '\0' || c == '/' || c == '$') break;
+    if (c == '\\') {
+      decode_symbols(r, decoded);
+      raw += (char)get();
+      decoded = raw.size();
+      read_char(raw);
+      decode_symbols(r, decoded);
+      decoded = raw.size();
+    } else if (c == '<') {
+      decode_symbols(r, decoded);
+      tag.clear();
+      read_block(tag, '>');
+      raw += tag;
+      decoded = raw.size();
+      auto loc = tag_ids.find(tag);
+      if (loc == tag_ids.end()) {
+        loc = tag_ids.insert(std::make_pair(tag, alpha(to_ustring(tag.c_str())))).first;
+      }
+      r->symbols.push_back(loc->second);
+    } else {
+      raw += c;
+      pos++;
+    }
+  }
+  decode_symbols(r, decoded);
+}
+
+void StreamReader::read_lu(LU* lu, const Alphabet& alpha)
+{
+  PROFILE_SCOPE(PROF_READ);
+  read_blank(lu->blank);
+  if (peek() == '^') {
+    get();
+    lu->src = lu->new_reading();
+    read_reading(lu->src, alpha);
+    while (peek() == '/') {
+      get();
+      Reading* t = lu->new_reading();
+      read_reading(t, alpha);
+      lu->trg.push_back(t);
+    }
+    if (peek() == '$') get();
+  }
+}
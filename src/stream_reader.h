@@ -0,0 +1,54 @@
+#ifndef __SELECTOR_STREAM_READER_H__
+#define __SELECTOR_STREAM_READER_H__
+
+#include "lu.h"
+#include <string>
+#include <unordered_map>
+
+// reads LUs from an Apertium stream in large blocks with read(2)
+// rather than a character at a time through InputFile
+// runs of ordinary bytes are found by scanning a block at a time for
+// the bytes that mean something in the stream and copied as raw UTF-8,
+// and tags are looked up in the Alphabet once per reader
+class StreamReader {
+private:
+  int fd = 0;
+  bool owns_fd = false;
+  std::vector<char> buffer;
+  size_t pos = 0;
+  size_t end = 0;
+  // raw tag (with < and >) => symbol
+  std::unordered_map<std::string, int32_t> tag_ids;
+  std::string tag;
+
+  // read more input if the buffer is used up
+  // return the number of unread bytes
+  size_t fill();
+  // index of the first byte at or after from which might be special
+  size_t scan(size_t from) const;
+  // append one (possibly multibyte) character
+  void read_char(std::string& out);
+  // append everything up to and including end_c, handling escapes
+  void read_block(std::string& out, char end_c);
+  void read_blank(std::string& blank);
+  void read_reading(Reading* r, const Alphabet& alpha);
+  // add symbols for the characters in r's raw form from index from
+  void decode_symbols(Reading* r, size_t from);
+public:
+  StreamReader(size_t buffer_size = 1 << 20);
+  ~StreamReader();
+  // read fname, or stdin if fname is null or empty
+  bool open(const char* fname);
+  void open_or_exit(const char* fname);
+  // read from an already open descriptor, which is not closed
+  void wrap(int new_fd);
+  bool eof();
+  // next byte, or -1 at the end of input
+  int peek();
+  int get();
+  // read the next LU, leaving it with no source reading at the end
+  // of the input or at \0
+  void read_lu(LU* lu, const Alphabet& alpha);
+};
+
+#endif
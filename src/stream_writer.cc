@@ -0,0 +1,71 @@
+#include "stream_writer.h"
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+StreamWriter::StreamWriter(size_t buffer_size)
+  : buffer(buffer_size)
+{}
+
+StreamWriter::~StreamWriter()
+{
+  flush();
+  if (owns_fd) close(fd);
+}
+
+bool StreamWriter::open(const char* fname)
+{
+  flush();
+  if (owns_fd) close(fd);
+  owns_fd = false;
+  failed = false;
+  fd = 1;
+  if (fname == nullptr || *fname == '\0') return true;
+  fd = ::open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    fd = 1;
+    return false;
+  }
+  owns_fd = true;
+  return true;
+}
+
+void StreamWriter::open_or_exit(const char* fname)
+{
+  if (!open(fname)) {
+    std::cerr << "Error: Unable to open '" << fname << "' for writing." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void StreamWriter::wrap(int new_fd)
+{
+  flush();
+  if (owns_fd) close(fd);
+  owns_fd = false;
+  failed = false;
+  fd = new_fd;
+}
+
+void StreamWriter::write_fd(const char* s, size_t n)
+{
+  while (n > 0 && !failed) {
+    ssize_t w = ::write(fd, s, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      break;
+    }
+    s += w;
+    n -= (size_t)w;
+  }
+}
+
+void StreamWriter::flush()
+{
+  if (len == 0) return;
+  write_fd(buffer.data(), len);
+  len = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __SELECTOR_STREAM_WRITER_H__
+#define __SELECTOR_STREAM_WRITER_H__
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+// buffered output of UTF-8 bytes with write(2)
+// nothing is written until the buffer is full or flush() is called
+class StreamWriter {
+private:
+  int fd = 1;
+  bool owns_fd = false;
+  bool failed = false;
+  std::vector<char> buffer;
+  size_t len = 0;
+  void write_fd(const char* s, size_t n);
+public:
+  StreamWriter(size_t buffer_size = 1 << 20);
+  ~StreamWriter();
+  // write to fname, or stdout if fname is null or empty
+  bool open(const char* fname);
+  void open_or_exit(const char* fname);
+  // write to an already open descriptor, which is not closed
+  void wrap(int new_fd);
+  void write(const char* s, size_t n)
+  {
+    if (n > buffer.size() - len) {
+      flush();
+      if (n > buffer.size()) {
+        write_fd(s, n);
+        return;
+      }
+    }
+    memcpy(buffer.data() + len, s, n);
+    len += n;
+  }
+  void write(const std::string& s) { write(s.data(), s.size()); }
+  void put(char c)
+  {
+    if (len == buffer.size()) flush();
+    buffer[len++] = c;
+  }
+  void flush();
+  // false if a write has failed (e.g. the reader went away),
+  // after which output is discarded
+  bool good() { return !failed; }
+};
+
+#endif
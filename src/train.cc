@@ -1,32 +1,133 @@
 #include "train.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <unistd.h>
 
-void SelectorTrainer::clear_examples()
+// FNV-1a over everything the instances depend on
+namespace {
+struct Fingerprint {
+  uint64_t h = 0xCBF29CE484222325ull;
+  void add(const void* data, size_t n)
+  {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; i++) {
+      h ^= p[i];
+      h *= 0x100000001B3ull;
+    }
+  }
+  template<typename T>
+  void add(const T& v) { add(&v, sizeof(T)); }
+};
+}
+
+// the LU as it appeared in the input
+static void add_lu(Fingerprint& fp, LU* lu)
+{
+  fp.add((uint64_t)lu->get_blank().size());
+  fp.add(lu->get_blank().data(), lu->get_blank().size());
+  if (lu->isEOF()) return;
+  fp.add((uint64_t)lu->get_src()->get_raw().size());
+  fp.add(lu->get_src()->get_raw().data(), lu->get_src()->get_raw().size());
+  fp.add((uint64_t)lu->get_trg().size());
+  for (auto& r : lu->get_trg()) {
+    fp.add((uint64_t)r->get_raw().size());
+    fp.add(r->get_raw().data(), r->get_raw().size());
+  }
+}
+
+SelectorTrainer::~SelectorTrainer()
+{
+  clear_sentence();
+  clear_corpus(examples);
+  clear_corpus(heldout);
+  if (spill) fclose(spill);
+}
+
+void SelectorTrainer::clear_corpus(std::vector<TrainingSentence>& corpus)
 {
-  for (auto& ex : examples) {
-    for (auto& it : ex) {
+  for (auto& sent : corpus) {
+    for (auto& it : sent) {
       delete it.first;
     }
   }
+  corpus.clear();
+}
+
+void SelectorTrainer::clear_sentence()
+{
+  for (auto& it : sentence) {
+    delete it.first;
+  }
+  sentence.clear();
 }
 
 void SelectorTrainer::error(const char* msg)
 {
   std::cerr << "ERROR at line " << cur_line
-            << ", LU " << (examples.back().size() + 1)
+            << ", LU " << (sentence.size() + 1)
             << ": " << msg << std::endl;
   exit(EXIT_FAILURE);
 }
 
-void SelectorTrainer::load_corpus(InputFile& raw, InputFile& gold)
+void SelectorTrainer::open_spill(bool existing)
+{
+  if (spill_path.empty() && buffer_size == 0) return;
+  if (buffer_size == 0) buffer_size = 64 << 20;
+  if (spill_path.empty()) {
+    spill = tmpfile();
+  } else {
+    spill = fopen(spill_path.c_str(), existing ? "rb" : "w+b");
+  }
+  if (spill == nullptr) {
+    std::cerr << "ERROR: Unable to open spill file "
+              << (spill_path.empty() ? "(temporary)" : spill_path)
+              << ": " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (!existing) spill_offsets.assign(1, 0);
+}
+
+void SelectorTrainer::init_pairs()
 {
-  clear_examples();
-  examples.resize(1);
+  auto weights = fs.get_sorted_weights();
+  pairs.clear();
+  pairs.reserve(weights.size());
+  params.weights.clear();
+  params.weights.reserve(weights.size());
+  for (auto& it : weights) {
+    pairs.push_back(it.first);
+    params.weights.push_back(it.second);
+  }
+  if (pairs.size() > UINT32_MAX) {
+    std::cerr << "ERROR: more than " << UINT32_MAX << " weights." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void SelectorTrainer::load_corpus(StreamReader& raw, StreamReader& gold,
+                                  std::vector<TrainingSentence>* keep)
+{
+  clear_sentence();
+  if (keep) {
+    clear_corpus(*keep);
+  } else {
+    corpus.clear();
+    sentence_starts.assign(1, 0);
+  }
   cur_line = 1;
+  Fingerprint fp;
   while (!raw.eof()) {
     LU* lr = fs.read_lu(raw);
     LU* lg = fs.read_lu(gold);
+    add_lu(fp, lr);
+    add_lu(fp, lg);
     if (lg->isEOF() && !lr->isEOF()) {
       error("Gold file ends before gold file.");
     }
@@ -34,6 +135,8 @@ void SelectorTrainer::load_corpus(InputFile& raw, InputFile& gold)
       if (!lg->isEOF()) {
         error("Raw file ends before raw file.");
       }
+      delete lr;
+      delete lg;
       break;
     }
     size_t nlr = lr->after_newline();
@@ -42,14 +145,14 @@ void SelectorTrainer::load_corpus(InputFile& raw, InputFile& gold)
       error("Raw and Gold files have line breaks in different places.");
     }
     if (nlr) {
+      end_sentence(keep);
       cur_line += nlr;
-      examples.resize(examples.size()+1);
     }
     if (lr->get_trg().empty()) {
       error("Raw lexical unit has no targets.");
     }
     if (!lr->ambiguous()) {
-      examples.back().push_back(std::make_pair(lr, 0));
+      sentence.push_back(std::make_pair(lr, 0));
       delete lg;
       continue;
     }
@@ -60,7 +163,7 @@ void SelectorTrainer::load_corpus(InputFile& raw, InputFile& gold)
     auto& trg = lr->get_trg();
     size_t n = trg.size();
     for (size_t i = 0; i < trg.size(); i++) {
-      if (trg[i]->get_form() == gr->get_form()) {
+      if (trg[i]->get_raw() == gr->get_raw()) {
         n = i;
         break;
       }
@@ -68,89 +171,791 @@ void SelectorTrainer::load_corpus(InputFile& raw, InputFile& gold)
     if (n == trg.size()) {
       error("Gold target not present among raw targets.");
     }
-    examples.back().push_back(std::make_pair(lr, n));
+    sentence.push_back(std::make_pair(lr, n));
     delete lg;
   }
+  end_sentence(keep);
+  corpus_fp = fp.h;
+  if (spill && fflush(spill) != 0) {
+    std::cerr << "ERROR: Unable to write spill file: "
+              << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
 }
 
-void SelectorTrainer::update_weight(FeatPair f, double w)
+void SelectorTrainer::end_sentence(std::vector<TrainingSentence>* keep)
 {
-  double oldw = fs.get_weight(f);
-  fs.set_weight(f, oldw+w);
-  totals[f] += oldw * (cur_inst - last_update[f]);
-  last_update[f] = cur_inst;
+  if (keep) {
+    keep->push_back(sentence);
+    sentence.clear();
+    return;
+  }
+  size_t before = corpus.instances.size();
+  for (size_t i = 0; i < sentence.size(); i++) {
+    if (!sentence[i].first->ambiguous()) continue;
+    add_instance(i);
+  }
+  sentence_starts.push_back(sentence_starts.back() +
+                            (corpus.instances.size() - before));
+  if (spill) {
+    write_spill();
+    corpus.clear();
+  }
+  clear_sentence();
 }
 
-void SelectorTrainer::run_instance(size_t sentence, size_t word)
+void SelectorTrainer::get_context(const TrainingSentence& sent, size_t w,
+                                  FeatSet& feats)
 {
-  auto& sent = examples[sentence];
-  FeatSet context_feats;
-  for (size_t i = 1; i <= fs.get_lookbehind() && i <= word; i++) {
-    auto& pr = sent[word-i];
-    pr.first->get_src()->get_feats(-(int)i, context_feats);
-    pr.first->get_trg()[pr.second]->get_feats(-(int)i, context_feats);
+  for (size_t i = 1; i <= fs.get_lookbehind() && i <= w; i++) {
+    LU* lu = sent[w-i].first;
+    lu->get_src()->get_feats(-(int)i, feats);
+    lu->get_trg()[history[i-1]]->get_feats(-(int)i, feats);
   }
-  sent[word].first->get_src()->get_feats(0, context_feats);
+  sent[w].first->get_src()->get_feats(0, feats);
   for (size_t i = 1; i <= fs.get_lookahead(); i++) {
-    if (word + i == sent.size()) break;
-    sent[word+i].first->get_src()->get_feats(i, context_feats);
+    if (w + i == sent.size()) break;
+    sent[w+i].first->get_src()->get_feats(i, feats);
   }
-  std::vector<double> weights;
-  std::vector<FeatPairSet> feats;
+}
+
+void SelectorTrainer::get_pair_indices(FeatSet& feats, std::vector<uint32_t>& out)
+{
+  sorted_vector<FeatPair> fp;
+  fs.get_weight(feats, fp);
+  // fp is sorted, so the indices are too
+  auto loc = pairs.begin();
+  for (auto& p : fp) {
+    loc = std::lower_bound(loc, pairs.end(), p);
+    out.push_back((uint32_t)(loc - pairs.begin()));
+  }
+}
+
+void SelectorTrainer::add_instance(size_t word)
+{
+  auto& sent = sentence;
+  history.clear();
+  for (size_t i = 1; i <= fs.get_lookbehind() && i <= word; i++) {
+    history.push_back(sent[word-i].second);
+  }
+  FeatSet context_feats;
+  get_context(sent, word, context_feats);
+  TrainingInstance inst;
+  inst.gold = (uint32_t)sent[word].second;
+  inst.count = (uint32_t)sent[word].first->get_trg().size();
+  inst.first = corpus.candidate_offsets.size() - 1;
   for (auto& it : sent[word].first->get_trg()) {
     FeatSet fls = context_feats;
     it->get_feats(0, fls);
-    sorted_vector<FeatPair> fp;
-    weights.push_back(fs.get_weight(fls, fp));
-    feats.push_back(fp);
+    get_pair_indices(fls, corpus.pair_indices);
+    corpus.candidate_offsets.push_back(corpus.pair_indices.size());
   }
+  corpus.instances.push_back(inst);
+}
+
+// a spilled sentence is a sequence of uint32s: the number of
+// instances, then for each one its gold index, its number of
+// candidates, the number of pairs of each candidate and the pairs
+void SelectorTrainer::write_spill()
+{
+  std::vector<uint32_t> rec;
+  rec.push_back((uint32_t)corpus.instances.size());
+  const uint64_t* off = corpus.candidate_offsets.data();
+  for (auto& inst : corpus.instances) {
+    rec.push_back(inst.gold);
+    rec.push_back(inst.count);
+    for (size_t c = 0; c < inst.count; c++) {
+      rec.push_back((uint32_t)(off[inst.first+c+1] - off[inst.first+c]));
+    }
+    rec.insert(rec.end(),
+               corpus.pair_indices.begin() + (ptrdiff_t)off[inst.first],
+               corpus.pair_indices.begin() + (ptrdiff_t)off[inst.first+inst.count]);
+  }
+  if (fwrite(rec.data(), sizeof(uint32_t), rec.size(), spill) != rec.size()) {
+    std::cerr << "ERROR: Unable to write spill file: "
+              << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  spill_offsets.push_back(spill_offsets.back() + rec.size() * sizeof(uint32_t));
+}
+
+// append spilled sentences in buf to block
+static void decode_spill(const std::vector<uint32_t>& buf, InstanceBlock& block)
+{
+  const uint32_t* p = buf.data();
+  const uint32_t* end = p + buf.size();
+  while (p < end) {
+    uint32_t n = *p++;
+    for (uint32_t i = 0; i < n; i++) {
+      TrainingInstance inst;
+      inst.gold = *p++;
+      inst.count = *p++;
+      inst.first = block.candidate_offsets.size() - 1;
+      const uint32_t* lens = p;
+      p += inst.count;
+      for (uint32_t c = 0; c < inst.count; c++) {
+        block.pair_indices.insert(block.pair_indices.end(), p, p + lens[c]);
+        p += lens[c];
+        block.candidate_offsets.push_back(block.pair_indices.size());
+      }
+      block.instances.push_back(inst);
+    }
+  }
+}
+
+template<typename F>
+void SelectorTrainer::for_each_instance(const std::vector<size_t>& sents,
+                                        size_t limit, F f)
+{
+  if (spill == nullptr) {
+    for (auto& s : sents) {
+      for (uint64_t i = sentence_starts[s]; i < sentence_starts[s+1]; i++) {
+        f(corpus, corpus.instances[i]);
+      }
+    }
+    return;
+  }
+  // read runs of consecutive sentences with one pread() each
+  // pread() doesn't move the file position, so threads can share spill
+  int fd = fileno(spill);
+  InstanceBlock block;
+  std::vector<uint32_t> buf;
+  size_t i = 0;
+  while (i < sents.size()) {
+    size_t j = i + 1;
+    while (j < sents.size() && sents[j] == sents[j-1] + 1 &&
+           spill_offsets[sents[j]+1] - spill_offsets[sents[i]] <= limit) {
+      j++;
+    }
+    uint64_t from = spill_offsets[sents[i]];
+    size_t len = spill_offsets[sents[j-1]+1] - from;
+    buf.resize(len / sizeof(uint32_t));
+    char* dst = (char*)buf.data();
+    size_t done = 0;
+    while (done < len) {
+      ssize_t r = pread(fd, dst + done, len - done, (off_t)(from + done));
+      if (r <= 0) {
+        std::cerr << "ERROR: Unable to read spill file: "
+                  << (r < 0 ? strerror(errno) : "unexpected end of file")
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      done += (size_t)r;
+    }
+    block.clear();
+    decode_spill(buf, block);
+    for (auto& inst : block.instances) f(block, inst);
+    i = j;
+  }
+}
+
+// index of the highest-scoring candidate of inst, with the weight
+// of pair i given by weight(i)
+template<typename F>
+static size_t predict(const TrainingInstance& inst, const uint32_t* idx,
+                      const uint64_t* offsets, F weight)
+{
+  const uint64_t* off = offsets + inst.first;
   size_t max = 0;
-  for (size_t i = 1; i < weights.size(); i++) {
-    if (weights[i] > weights[max]) max = i;
+  double max_weight = 0.0;
+  for (size_t c = 0; c < inst.count; c++) {
+    double w = 0.0;
+    for (uint64_t k = off[c]; k < off[c+1]; k++) w += weight(idx[k]);
+    if (c == 0 || w > max_weight) {
+      max = c;
+      max_weight = w;
+    }
+  }
+  return max;
+}
+
+// call update(i, d) for pairs only in candidate good (d = 1)
+// or only in candidate bad (d = -1)
+template<typename F>
+static void update_pairs(const TrainingInstance& inst, size_t bad_idx,
+                         const uint32_t* idx, const uint64_t* offsets, F update)
+{
+  const uint64_t* off = offsets + inst.first;
+  const uint32_t* good = idx + off[inst.gold];
+  const uint32_t* good_end = idx + off[inst.gold+1];
+  const uint32_t* bad = idx + off[bad_idx];
+  const uint32_t* bad_end = idx + off[bad_idx+1];
+  while (good != good_end || bad != bad_end) {
+    if (bad == bad_end || (good != good_end && *good < *bad)) {
+      update(*good++, 1.0);
+    } else if (good == good_end || *bad < *good) {
+      update(*bad++, -1.0);
+    } else {
+      good++;
+      bad++;
+    }
   }
+}
+
+void SelectorTrainer::run_instance(const InstanceBlock& b,
+                                   const TrainingInstance& inst)
+{
+  const double* w = params.weights.data();
+  size_t max = predict(inst, b.pair_indices.data(), b.candidate_offsets.data(),
+                       [&](uint32_t k) { return w[k]; });
   // prediction correct => done
-  if (max == sent[word].second) return;
+  if (max == inst.gold) return;
   // prediction incorrect => update weights
-  FeatPairSet good = feats[sent[word].second];
-  FeatPairSet bad = feats[max];
-  for (auto& it : good) {
-    if (bad.count(it)) bad.erase(it);
-    else update_weight(it, 1);
-  }
-  for (auto& it : bad) update_weight(it, -1);
+  // pairs only in the good candidate go up, pairs only in the bad go down
+  update_pairs(inst, max, b.pair_indices.data(), b.candidate_offsets.data(),
+               [&](uint32_t k, double d) { params.update(k, d); });
   // TODO: check and warn if feats are identical?
 }
 
+size_t SelectorTrainer::get_train_beam()
+{
+  return (train_beam ? train_beam : fs.get_beam_size());
+}
+
+void SelectorTrainer::search_step(const TrainingSentence& sent, size_t w,
+                                  size_t beam, bool keep_pairs)
+{
+  LU* cur = sent[w].first;
+  const double* weights = params.weights.data();
+  auto& last = path[w];
+  candidates.clear();
+  size_t n_cand = last.size() * cur->get_trg().size();
+  if (candidate_pairs.size() < n_cand) candidate_pairs.resize(n_cand);
+  std::vector<uint32_t> idx;
+  for (size_t sidx = 0; sidx < last.size(); sidx++) {
+    history.clear();
+    size_t p = sidx;
+    for (size_t i = 1; i <= fs.get_lookbehind() && i <= w; i++) {
+      history.push_back(path[w-i+1][p].ridx);
+      p = path[w-i+1][p].prev;
+    }
+    FeatSet context_feats;
+    get_context(sent, w, context_feats);
+    for (size_t ridx = 0; ridx < cur->get_trg().size(); ridx++) {
+      FeatSet fls = context_feats;
+      cur->get_trg()[ridx]->get_feats(0, fls);
+      auto& out = (keep_pairs ? candidate_pairs[candidates.size()] : idx);
+      out.clear();
+      get_pair_indices(fls, out);
+      double score = last[sidx].score;
+      for (auto& k : out) score += weights[k];
+      candidates.push_back({score, (uint32_t)ridx, (uint32_t)sidx});
+    }
+  }
+  // the same order as Selector's beam: best first,
+  // ties by reading, then by previous state
+  order.resize(candidates.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    auto& x = candidates[a];
+    auto& y = candidates[b];
+    if (x.score != y.score) return x.score > y.score;
+    if (x.ridx != y.ridx) return x.ridx < y.ridx;
+    return x.prev < y.prev;
+  });
+  size_t keep = order.size();
+  if (!cur->ambiguous()) keep = 1;
+  else if (beam && keep > beam) keep = beam;
+  if (path.size() < w + 2) path.resize(w + 2);
+  path[w+1].clear();
+  if (keep_pairs && path_pairs.size() < w + 2) path_pairs.resize(w + 2);
+  if (keep_pairs && path_pairs[w+1].size() < keep) path_pairs[w+1].resize(keep);
+  for (size_t i = 0; i < keep; i++) {
+    path[w+1].push_back(candidates[order[i]]);
+    if (keep_pairs) path_pairs[w+1][i].swap(candidate_pairs[order[i]]);
+  }
+}
+
+void SelectorTrainer::update_prefix(size_t w,
+                                    const std::vector<std::vector<uint32_t>>& gold_pairs)
+{
+  std::vector<uint32_t> good;
+  std::vector<uint32_t> bad;
+  size_t p = 0;
+  for (size_t i = w + 1; i > 0; i--) {
+    auto& pp = path_pairs[i][p];
+    bad.insert(bad.end(), pp.begin(), pp.end());
+    good.insert(good.end(), gold_pairs[i-1].begin(), gold_pairs[i-1].end());
+    p = path[i][p].prev;
+  }
+  std::sort(good.begin(), good.end());
+  std::sort(bad.begin(), bad.end());
+  // a pair counts once per word it occurs in
+  size_t g = 0;
+  size_t b = 0;
+  while (g < good.size() || b < bad.size()) {
+    uint32_t k = (b == bad.size() || (g < good.size() && good[g] < bad[b]) ?
+                  good[g] : bad[b]);
+    double d = 0.0;
+    while (g < good.size() && good[g] == k) { d += 1.0; g++; }
+    while (b < bad.size() && bad[b] == k) { d -= 1.0; b++; }
+    if (d != 0.0) params.update(k, d);
+  }
+}
+
+void SelectorTrainer::run_sentence(const TrainingSentence& sent)
+{
+  size_t beam = get_train_beam();
+  path.resize(1);
+  path[0].assign(1, {0.0, 0, 0});
+  std::vector<std::vector<uint32_t>> gold_pairs(sent.size());
+  double gold_score = 0.0;
+  // index of the gold path's state in path, while it is in the beam
+  size_t gold_idx = 0;
+  bool gold_in_beam = true;
+  size_t worst = sent.size();
+  double worst_violation = 0.0;
+  const double* weights = params.weights.data();
+  for (size_t w = 0; w < sent.size(); w++) {
+    search_step(sent, w, beam, true);
+    history.clear();
+    for (size_t i = 1; i <= fs.get_lookbehind() && i <= w; i++) {
+      history.push_back(sent[w-i].second);
+    }
+    FeatSet fls;
+    get_context(sent, w, fls);
+    sent[w].first->get_trg()[sent[w].second]->get_feats(0, fls);
+    get_pair_indices(fls, gold_pairs[w]);
+    for (auto& k : gold_pairs[w]) gold_score += weights[k];
+    if (gold_in_beam) {
+      gold_in_beam = false;
+      for (size_t i = 0; i < path[w+1].size(); i++) {
+        if (path[w+1][i].prev == gold_idx && path[w+1][i].ridx == sent[w].second) {
+          gold_idx = i;
+          gold_in_beam = true;
+          break;
+        }
+      }
+    }
+    if (update_mode == UPDATE_EARLY) {
+      if (!gold_in_beam) {
+        update_prefix(w, gold_pairs);
+        return;
+      }
+    } else if (!gold_in_beam || gold_idx != 0) {
+      double v = path[w+1][0].score - gold_score;
+      if (worst == sent.size() || v > worst_violation) {
+        worst = w;
+        worst_violation = v;
+      }
+    }
+  }
+  if (update_mode == UPDATE_EARLY) {
+    if (!sent.empty() && gold_idx != 0) update_prefix(sent.size()-1, gold_pairs);
+  } else if (worst < sent.size()) {
+    update_prefix(worst, gold_pairs);
+  }
+}
+
 void SelectorTrainer::run_iteration()
 {
-  cur_inst = 0;
-  totals = fs.get_all_weights();
-  last_update.clear();
-  for (auto& it : totals) {
-    last_update.insert(std::make_pair(it.first, 0));
-  }
-  for (size_t i = 0; i < examples.size(); i++) {
-    for (size_t j = 0; j < examples[i].size(); j++) {
-      if (!examples[i][j].first->ambiguous()) continue;
-      cur_inst++;
-      run_instance(i, j);
-    }
-  }
-  if (cur_inst) {
-    for (auto& it : totals) {
-      if (last_update[it.first] > 0) {
-        it.second += fs.get_weight(it.first) * (cur_inst - last_update[it.first]);
-        it.second /= cur_inst;
-        fs.set_weight(it.first, it.second);
+  if (update_mode != UPDATE_GREEDY) {
+    params.begin_epoch();
+    for (auto& sent : examples) {
+      params.cur_inst++;
+      run_sentence(sent);
+    }
+    params.average();
+    return;
+  }
+  if (threads > 1) {
+    if (hogwild) run_iteration_hogwild();
+    else run_iteration_mixed();
+    return;
+  }
+  std::vector<size_t> all(sentence_starts.size() - 1);
+  for (size_t i = 0; i < all.size(); i++) all[i] = i;
+  params.begin_epoch();
+  for_each_instance(all, buffer_size,
+                    [&](const InstanceBlock& b, const TrainingInstance& inst) {
+                      params.cur_inst++;
+                      run_instance(b, inst);
+                    });
+  params.average();
+}
+
+std::vector<std::vector<size_t>> SelectorTrainer::make_shards()
+{
+  size_t n_sent = sentence_starts.size() - 1;
+  std::vector<size_t> order(n_sent);
+  for (size_t i = 0; i < n_sent; i++) order[i] = i;
+  if (seed) {
+    std::mt19937_64 rng(seed + cur_iter);
+    std::shuffle(order.begin(), order.end(), rng);
+  }
+  std::vector<std::vector<size_t>> shards(threads);
+  size_t target = (sentence_starts.back() + threads - 1) / threads;
+  size_t shard = 0;
+  size_t in_shard = 0;
+  for (auto& s : order) {
+    if (in_shard >= target && shard + 1 < threads) {
+      shard++;
+      in_shard = 0;
+    }
+    shards[shard].push_back(s);
+    in_shard += sentence_starts[s+1] - sentence_starts[s];
+  }
+  return shards;
+}
+
+void SelectorTrainer::run_iteration_mixed()
+{
+  size_t n_pairs = pairs.size();
+  auto shards = make_shards();
+  std::vector<ParamStore> shard_params(threads);
+  std::vector<uint64_t> counts(threads, 0);
+
+  auto run_shard = [&](size_t t) {
+    ParamStore& ps = shard_params[t];
+    ps.weights = params.weights;
+    ps.begin_epoch();
+    const double* w = ps.weights.data();
+    for_each_instance(shards[t], buffer_size / threads,
+                      [&](const InstanceBlock& b, const TrainingInstance& inst) {
+      ps.cur_inst++;
+      size_t max = predict(inst, b.pair_indices.data(), b.candidate_offsets.data(),
+                           [&](uint32_t k) { return w[k]; });
+      if (max == inst.gold) return;
+      update_pairs(inst, max, b.pair_indices.data(), b.candidate_offsets.data(),
+                   [&](uint32_t k, double d) { ps.update(k, d); });
+    });
+    ps.average();
+    counts[t] = ps.cur_inst;
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) workers.emplace_back(run_shard, t);
+  for (auto& it : workers) it.join();
+
+  uint64_t total = 0;
+  for (auto& c : counts) total += c;
+  if (total == 0) return;
+  for (size_t k = 0; k < n_pairs; k++) {
+    double w = 0.0;
+    for (size_t t = 0; t < threads; t++) {
+      if (counts[t]) w += shard_params[t].weights[k] * (double)counts[t];
+    }
+    params.weights[k] = w / (double)total;
+  }
+}
+
+void SelectorTrainer::run_iteration_hogwild()
+{
+  size_t n_pairs = pairs.size();
+  const std::vector<double>& start = params.weights;
+  std::unique_ptr<std::atomic<double>[]> w(new std::atomic<double>[n_pairs]);
+  for (size_t k = 0; k < n_pairs; k++) w[k].store(start[k], std::memory_order_relaxed);
+  auto shards = make_shards();
+  // each thread's share of the running totals for averaging, using
+  // the shared weights as they were when it updated them
+  std::vector<std::vector<double>> totals(threads);
+  std::vector<std::vector<uint64_t>> last(threads);
+  std::vector<uint64_t> counts(threads, 0);
+
+  auto run_shard = [&](size_t t) {
+    totals[t].assign(n_pairs, 0.0);
+    last[t].assign(n_pairs, 0);
+    uint64_t cur = 0;
+    for_each_instance(shards[t], buffer_size / threads,
+                      [&](const InstanceBlock& b, const TrainingInstance& inst) {
+      cur++;
+      size_t max = predict(inst, b.pair_indices.data(), b.candidate_offsets.data(),
+                           [&](uint32_t k) {
+                             return w[k].load(std::memory_order_relaxed);
+                           });
+      if (max == inst.gold) return;
+      update_pairs(inst, max, b.pair_indices.data(), b.candidate_offsets.data(),
+                   [&](uint32_t k, double d) {
+                     double old = w[k].load(std::memory_order_relaxed);
+                     totals[t][k] += old * (double)(cur - last[t][k]);
+                     last[t][k] = cur;
+                     w[k].store(old + d, std::memory_order_relaxed);
+                   });
+    });
+    counts[t] = cur;
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) workers.emplace_back(run_shard, t);
+  for (auto& it : workers) it.join();
+
+  uint64_t total = 0;
+  for (auto& c : counts) total += c;
+  if (total == 0) return;
+  for (size_t k = 0; k < n_pairs; k++) {
+    double end = w[k].load(std::memory_order_relaxed);
+    bool updated = false;
+    double sum = start[k];
+    for (size_t t = 0; t < threads; t++) {
+      if (last[t][k] > 0) {
+        updated = true;
+        sum += totals[t][k] + end * (double)(counts[t] - last[t][k]);
+      } else {
+        sum += end * (double)counts[t];
       }
     }
+    if (updated) params.weights[k] = sum / (double)total;
   }
 }
 
-void SelectorTrainer::train(InputFile& raw, InputFile& gold, size_t iterations)
+uint64_t SelectorTrainer::model_fingerprint()
 {
-  load_corpus(raw, gold);
-  for (cur_iter = 1; cur_iter <= iterations; cur_iter++) {
+  Fingerprint fp;
+  fp.add((uint64_t)fs.get_lookbehind());
+  fp.add((uint64_t)fs.get_lookahead());
+  auto& patterns = fs.get_patterns();
+  fp.add((uint64_t)patterns.size());
+  for (auto& feat : patterns) {
+    fp.add((uint64_t)feat.size());
+    for (auto& pat : feat) {
+      fp.add((uint64_t)pat.size());
+      fp.add(pat.data(), pat.size() * sizeof(UChar));
+    }
+  }
+  fp.add((uint64_t)pairs.size());
+  for (auto& it : pairs) {
+    fp.add((int64_t)it.first.first);
+    fp.add(it.first.second);
+    fp.add((int64_t)it.second.first);
+    fp.add(it.second.second);
+  }
+  return fp.h;
+}
+
+uint64_t SelectorTrainer::corpus_fingerprint(StreamReader& raw, StreamReader& gold)
+{
+  Fingerprint fp;
+  LU lr, lg;
+  while (!raw.eof()) {
+    lr.clear();
+    lg.clear();
+    raw.read_lu(&lr, fs.get_alpha());
+    gold.read_lu(&lg, fs.get_alpha());
+    add_lu(fp, &lr);
+    add_lu(fp, &lg);
+    if (lr.isEOF()) break;
+  }
+  return fp.h;
+}
+
+// checkpoint format, all in native byte order:
+// CHECKPOINT_MAGIC, model fingerprint, corpus fingerprint,
+// iteration, epochs without improvement,
+// best accuracy (double), number of pairs,
+// current weights, number of best weights (0 or the number of pairs),
+// best weights,
+// number of spilled sentences (0 if not spilled to a named file),
+// sentence_starts, spill_offsets
+static const char CHECKPOINT_MAGIC[8] = {'S','E','L','C','K','P','T','2'};
+
+template<typename T>
+static void write_vals(FILE* f, const T* v, size_t n)
+{
+  if (n && fwrite(v, sizeof(T), n, f) != n) {
+    std::cerr << "ERROR: Unable to write checkpoint: "
+              << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+template<typename T>
+static bool read_vals(FILE* f, T* v, size_t n)
+{
+  return (n == 0 || fread(v, sizeof(T), n, f) == n);
+}
+
+void SelectorTrainer::write_checkpoint()
+{
+  std::string tmp = checkpoint_path + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    std::cerr << "ERROR: Unable to open " << tmp << ": "
+              << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  uint64_t head[3] = {cur_iter, stale_epochs, pairs.size()};
+  write_vals(f, CHECKPOINT_MAGIC, 8);
+  write_vals(f, &model_fp, 1);
+  write_vals(f, &corpus_fp, 1);
+  write_vals(f, head, 2);
+  write_vals(f, &best_accuracy, 1);
+  write_vals(f, head + 2, 1);
+  write_vals(f, params.weights.data(), pairs.size());
+  uint64_t n_best = best_weights.size();
+  write_vals(f, &n_best, 1);
+  write_vals(f, best_weights.data(), best_weights.size());
+  uint64_t n_sent = 0;
+  if (spill && !spill_path.empty()) n_sent = sentence_starts.size() - 1;
+  write_vals(f, &n_sent, 1);
+  if (n_sent) {
+    write_vals(f, sentence_starts.data(), n_sent + 1);
+    write_vals(f, spill_offsets.data(), n_sent + 1);
+  }
+  if (fclose(f) != 0 || rename(tmp.c_str(), checkpoint_path.c_str()) != 0) {
+    std::cerr << "ERROR: Unable to write checkpoint " << checkpoint_path
+              << ": " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+bool SelectorTrainer::read_checkpoint()
+{
+  FILE* f = fopen(checkpoint_path.c_str(), "rb");
+  if (f == nullptr) return false;
+  char magic[8];
+  uint64_t fps[2];
+  uint64_t head[3];
+  uint64_t n_sent = 0;
+  uint64_t n_best = 0;
+  bool ok = (read_vals(f, magic, 8) &&
+             memcmp(magic, CHECKPOINT_MAGIC, 8) == 0 &&
+             read_vals(f, fps, 2) && fps[0] == model_fp &&
+             read_vals(f, head, 2) && read_vals(f, &best_accuracy, 1) &&
+             read_vals(f, head + 2, 1) && head[2] == pairs.size());
+  if (ok) {
+    params.weights.resize(pairs.size());
+    ok = (read_vals(f, params.weights.data(), pairs.size()) &&
+          read_vals(f, &n_best, 1) &&
+          (n_best == 0 || n_best == pairs.size()));
+    if (ok) {
+      best_weights.resize(n_best);
+      ok = (read_vals(f, best_weights.data(), n_best) &&
+            read_vals(f, &n_sent, 1));
+    }
+  }
+  if (ok && n_sent) {
+    sentence_starts.resize(n_sent + 1);
+    spill_offsets.resize(n_sent + 1);
+    ok = (read_vals(f, sentence_starts.data(), n_sent + 1) &&
+          read_vals(f, spill_offsets.data(), n_sent + 1));
+  }
+  fclose(f);
+  if (!ok) {
+    std::cerr << "ERROR: " << checkpoint_path
+              << " is not a checkpoint for these weights." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  checkpoint_corpus_fp = fps[1];
+  cur_iter = head[0];
+  stale_epochs = head[1];
+  if (best_weights.empty()) best_accuracy = -1.0;
+  // the instances can only be reused if they were spilled to a named
+  // file which is still complete
+  spill_resumed = false;
+  if (n_sent && !spill_path.empty() && update_mode == UPDATE_GREEDY) {
+    open_spill(true);
+    fseek(spill, 0, SEEK_END);
+    long size = ftell(spill);
+    if (size >= 0 && (uint64_t)size == spill_offsets.back()) {
+      spill_resumed = true;
+    } else {
+      std::cerr << "Warning: " << spill_path << " does not match the "
+                << "checkpoint, reading the corpus again." << std::endl;
+      fclose(spill);
+      spill = nullptr;
+    }
+  }
+  return true;
+}
+
+void SelectorTrainer::train(StreamReader& raw, StreamReader& gold, size_t iterations)
+{
+  init_pairs();
+  size_t start = 1;
+  best_accuracy = -1.0;
+  stale_epochs = 0;
+  spill_resumed = false;
+  if (!checkpoint_path.empty()) {
+    model_fp = model_fingerprint();
+    // keep the instances next to the checkpoint
+    if (spill_path.empty() && update_mode == UPDATE_GREEDY) {
+      spill_path = checkpoint_path + ".spill";
+    }
+  }
+  bool resumed = (!checkpoint_path.empty() && read_checkpoint());
+  if (spill_resumed) {
+    // instances are already in the spill file, so the corpus is only
+    // read to check that it's the one they were built from
+    corpus_fp = corpus_fingerprint(raw, gold);
+  } else if (update_mode == UPDATE_GREEDY) {
+    open_spill(false);
+    load_corpus(raw, gold);
+  } else {
+    load_corpus(raw, gold, &examples);
+  }
+  if (resumed) {
+    if (corpus_fp != checkpoint_corpus_fp) {
+      std::cerr << "ERROR: " << checkpoint_path
+                << " is not a checkpoint for this corpus." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::cerr << "Resuming after iteration " << cur_iter << std::endl;
+    start = cur_iter + 1;
+  }
+  bool stop = (has_heldout() && patience && stale_epochs >= patience);
+  for (cur_iter = start; cur_iter <= iterations && !stop; cur_iter++) {
     run_iteration();
+    if (has_heldout()) {
+      double acc = evaluate(fs.get_beam_size());
+      std::cerr << "iteration " << cur_iter << ": held-out accuracy "
+                << (acc * 100.0) << "%" << std::endl;
+      if (acc > best_accuracy) {
+        best_accuracy = acc;
+        best_weights = params.weights;
+        stale_epochs = 0;
+      } else {
+        stale_epochs++;
+      }
+      stop = (patience && stale_epochs >= patience);
+    }
+    if (!checkpoint_path.empty()) write_checkpoint();
+  }
+  if (has_heldout() && !best_weights.empty()) params.weights = best_weights;
+  for (size_t k = 0; k < pairs.size(); k++) {
+    fs.set_weight(pairs[k], params.weights[k]);
   }
 }
+
+void SelectorTrainer::load_heldout(StreamReader& raw, StreamReader& gold)
+{
+  load_corpus(raw, gold, &heldout);
+}
+
+double SelectorTrainer::evaluate(size_t beam)
+{
+  if (pairs.empty()) init_pairs();
+  uint64_t correct = 0;
+  uint64_t total = 0;
+  for (auto& sent : heldout) {
+    path.resize(1);
+    path[0].assign(1, {0.0, 0, 0});
+    for (size_t w = 0; w < sent.size(); w++) {
+      search_step(sent, w, beam, false);
+    }
+    size_t p = 0;
+    for (size_t w = sent.size(); w > 0; w--) {
+      auto& state = path[w][p];
+      if (sent[w-1].first->ambiguous()) {
+        total++;
+        if (state.ridx == sent[w-1].second) correct++;
+      }
+      p = state.prev;
+    }
+  }
+  return (total ? (double)correct / (double)total : 0.0);
+}
+
+void SelectorTrainer::print_beam_curve(std::ostream& out,
+                                       const std::vector<size_t>& beams)
+{
+  for (auto& b : beams) {
+    out << "beam " << b << ": held-out accuracy "
+        << (evaluate(b) * 100.0) << "%" << std::endl;
+  }
+}
+
+void SelectorTrainer::print_stats(std::ostream& out)
+{
+  out << "feature cache hits: " << fs.get_cache_hits() << std::endl;
+  out << "feature cache misses: " << fs.get_cache_misses() << std::endl;
+}
@@ -2,28 +2,198 @@
 #define __SELECTOR_TRAINER_H__
 
 #include "feature_set.h"
+#include "param_store.h"
+#include <cstdio>
+#include <ostream>
+#include <string>
+
+// an ambiguous word in the training corpus
+// candidate c's features pairs are
+// pair_indices[candidate_offsets[first+c] .. candidate_offsets[first+c+1]]
+// of the block it belongs to
+struct TrainingInstance {
+  uint32_t gold;
+  uint32_t count;
+  uint64_t first;
+};
+
+// the instances of a run of sentences
+struct InstanceBlock {
+  std::vector<TrainingInstance> instances;
+  std::vector<uint64_t> candidate_offsets = {0};
+  std::vector<uint32_t> pair_indices;
+  void clear()
+  {
+    instances.clear();
+    candidate_offsets.assign(1, 0);
+    pair_indices.clear();
+  }
+};
+
+// (LU, index of the gold reading)
+typedef std::vector<std::pair<LU*, size_t>> TrainingSentence;
+
+// a hypothesis in the beam search used for structured training
+// and evaluation, reading ridx after state prev of the previous word
+struct SearchState {
+  double score;
+  uint32_t ridx;
+  uint32_t prev;
+};
 
 class SelectorTrainer {
+public:
+  enum UpdateMode {
+    // one update per ambiguous word, with the gold history
+    UPDATE_GREEDY,
+    // beam search, updating when the gold path leaves the beam
+    UPDATE_EARLY,
+    // beam search, updating on the prefix where the best path
+    // beats the gold path by most
+    UPDATE_MAX_VIOLATION
+  };
 private:
-  std::vector<std::vector<std::pair<LU*, size_t>>> examples;
-  size_t cur_inst = 0;
+  // the sentence being read
+  TrainingSentence sentence;
+  // sentences kept as LUs, for structured training
+  std::vector<TrainingSentence> examples;
+  std::vector<TrainingSentence> heldout;
+  // every pair in fs, in order
+  // training only changes the weights of existing pairs, so the
+  // indices stay valid
+  std::vector<FeatPair> pairs;
+  // the weights being trained, copied back to fs by train()
+  ParamStore params;
+  // every instance, or when spilling only those of the current sentence
+  InstanceBlock corpus;
+  // instances of sentence i are sentence_starts[i] .. sentence_starts[i+1]
+  std::vector<uint64_t> sentence_starts;
+  // when spilling, sentence i is stored in bytes
+  // spill_offsets[i] .. spill_offsets[i+1] of spill
+  FILE* spill = nullptr;
+  std::string spill_path;
+  std::vector<uint64_t> spill_offsets;
+  // bytes of spilled instances to hold in memory at once
+  size_t buffer_size = 0;
+  size_t threads = 1;
+  bool hogwild = false;
+  uint64_t seed = 0;
+  UpdateMode update_mode = UPDATE_GREEDY;
+  // beam size for structured training, 0 for the model's
+  size_t train_beam = 0;
+  // path[i+1] are the states for word i, path_pairs[i+1][j] the pair
+  // indices of state j's word
+  std::vector<std::vector<SearchState>> path;
+  std::vector<std::vector<std::vector<uint32_t>>> path_pairs;
+  std::vector<SearchState> candidates;
+  std::vector<std::vector<uint32_t>> candidate_pairs;
+  std::vector<size_t> order;
+  std::vector<size_t> history;
   size_t cur_iter = 0;
+  // stop once held-out accuracy hasn't improved for this many
+  // iterations, 0 to never stop early
+  size_t patience = 0;
+  size_t stale_epochs = 0;
+  double best_accuracy = -1.0;
+  std::vector<double> best_weights;
+  // written after every iteration, and read by train() to resume
+  // in greedy mode, the instances are spilled to checkpoint_path.spill
+  // if no other spill file is given, so that resuming only reads the
+  // corpus to check it against the checkpoint
+  std::string checkpoint_path;
+  bool spill_resumed = false;
+  uint64_t model_fp = 0;
+  // of the last corpus loaded
+  uint64_t corpus_fp = 0;
+  uint64_t checkpoint_corpus_fp = 0;
   size_t cur_line = 0;
   FeatureSet fs;
-  std::map<FeatPair, size_t> last_update;
-  std::map<FeatPair, double> totals;
-  void clear_examples();
+  void clear_sentence();
+  void clear_corpus(std::vector<TrainingSentence>& corpus);
   void error(const char* msg);
-  void load_corpus(InputFile& raw, InputFile& gold);
-  void update_weight(FeatPair f, double w);
-  void run_instance(size_t sentence, size_t word);
+  // if existing, reopen spill_path as left by an earlier run
+  void open_spill(bool existing);
+  void init_pairs();
+  // build the instances of each sentence as it is read, so the LUs of
+  // only one sentence are in memory at a time,
+  // or if keep is non-null, add the sentences to it
+  void load_corpus(StreamReader& raw, StreamReader& gold,
+                   std::vector<TrainingSentence>* keep = nullptr);
+  void end_sentence(std::vector<TrainingSentence>* keep);
+  // features of word w of sent other than its own reading's,
+  // with history[i-1] the reading of word w-i
+  void get_context(const TrainingSentence& sent, size_t w, FeatSet& feats);
+  // indices of the pairs matched by feats
+  void get_pair_indices(FeatSet& feats, std::vector<uint32_t>& out);
+  // the context uses the gold readings of previous words, so each
+  // candidate's feature pairs are the same in every iteration and
+  // are only found once
+  void add_instance(size_t word);
+  // append the instances in corpus to the spill file
+  void write_spill();
+  // call f(block, instance) for every instance of sents in order,
+  // reading them back from the spill file at most limit bytes at a time
+  template<typename F>
+  void for_each_instance(const std::vector<size_t>& sents, size_t limit, F f);
+  void run_instance(const InstanceBlock& b, const TrainingInstance& inst);
+  // expand path[w] into path[w+1] for word w of sent, keeping the
+  // best beam states (0 for all) or only the best one if the word is
+  // unambiguous, since Selector commits there
+  void search_step(const TrainingSentence& sent, size_t w, size_t beam,
+                   bool keep_pairs);
+  void run_sentence(const TrainingSentence& sent);
+  // update towards gold_pairs[0..w] and away from the best path to w
+  void update_prefix(size_t w,
+                     const std::vector<std::vector<uint32_t>>& gold_pairs);
+  size_t get_train_beam();
+  // hashes of what the instances were built from, stored in the
+  // checkpoint so that a changed model or corpus isn't resumed
+  uint64_t model_fingerprint();
+  // read the rest of raw and gold without building instances
+  uint64_t corpus_fingerprint(StreamReader& raw, StreamReader& gold);
+  void write_checkpoint();
+  // false if there is no checkpoint, exits if it is unusable
+  bool read_checkpoint();
   void run_iteration();
+  // split sentences into one shard per thread with about the same
+  // number of instances each
+  std::vector<std::vector<size_t>> make_shards();
+  // iterative parameter mixing: an averaged perceptron epoch on each
+  // shard, starting from the same weights, then the shards' averaged
+  // weights are mixed in proportion to their number of instances
+  void run_iteration_mixed();
+  // all threads update one set of weights without locking
+  void run_iteration_hogwild();
 public:
   SelectorTrainer() {}
-  ~SelectorTrainer() { clear_examples(); }
+  ~SelectorTrainer();
   void read(InputFile& input) { fs.read(input); }
   void write(UFILE* output) { fs.write(output); }
-  void train(InputFile& raw, InputFile& gold, size_t iterations);
+  // with a held-out set, keeps the weights of the best iteration
+  void train(StreamReader& raw, StreamReader& gold, size_t iterations);
+  void load_heldout(StreamReader& raw, StreamReader& gold);
+  bool has_heldout() { return !heldout.empty(); }
+  // fraction of ambiguous held-out words whose gold reading is chosen
+  // by beam search with the current weights (beam 0 for unlimited)
+  double evaluate(size_t beam);
+  void print_beam_curve(std::ostream& out, const std::vector<size_t>& beams);
+  bool determinize(size_t max_states) { return fs.determinize(max_states); }
+  void set_cache_size(size_t n) { fs.set_cache_size(n); }
+  void set_threads(size_t n) { threads = (n ? n : 1); }
+  void set_hogwild(bool b) { hogwild = b; }
+  // if non-zero, shuffle sentences between shards with this seed
+  void set_seed(uint64_t s) { seed = s; }
+  // keep instances in a spill file rather than in memory, reading at
+  // most n bytes of them at a time
+  void set_buffer_size(size_t n) { buffer_size = n; }
+  // spill to this file rather than an anonymous temporary file
+  void set_spill_file(const std::string& path) { spill_path = path; }
+  // structured modes keep the corpus in memory as LUs
+  void set_update_mode(UpdateMode m) { update_mode = m; }
+  void set_train_beam(size_t n) { train_beam = n; }
+  void set_patience(size_t n) { patience = n; }
+  void set_checkpoint(const std::string& path) { checkpoint_path = path; }
+  void print_stats(std::ostream& out);
 };
 
 #endif
@@ -0,0 +1,182 @@
+#include "vector_ops.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SELECTOR_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static float dot_portable(const float* x, const float* y, size_t n)
+{
+  float ret = 0.0f;
+  for (size_t i = 0; i < n; i++) ret += x[i] * y[i];
+  return ret;
+}
+
+static void axpy_portable(float a, const float* x, float* y, size_t n)
+{
+  for (size_t i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+#ifdef SELECTOR_X86_KERNELS
+
+// x + i and y + i stay aligned, since i only advances by whole vectors
+
+__attribute__((target("sse2")))
+static float dot_sse(const float* x, const float* y, size_t n)
+{
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(x + i), _mm_load_ps(y + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(x + i + 4),
+                                       _mm_load_ps(y + i + 4)));
+  }
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(x + i), _mm_load_ps(y + i)));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  float ret = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) ret += x[i] * y[i];
+  return ret;
+}
+
+__attribute__((target("sse2")))
+static void axpy_sse(float a, const float* x, float* y, size_t n)
+{
+  __m128 va = _mm_set1_ps(a);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_store_ps(y + i, _mm_add_ps(_mm_load_ps(y + i),
+                                    _mm_mul_ps(va, _mm_load_ps(x + i))));
+  }
+  for (; i < n; i++) y[i] += a * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float* x, const float* y, size_t n)
+{
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_load_ps(x + i), _mm256_load_ps(y + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_load_ps(x + i + 8),
+                           _mm256_load_ps(y + i + 8), acc1);
+  }
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_load_ps(x + i), _mm256_load_ps(y + i), acc0);
+  }
+  __m256 acc = _mm256_add_ps(acc0, acc1);
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc),
+                           _mm256_extractf128_ps(acc, 1));
+  half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+  float ret = _mm_cvtss_f32(half);
+  for (; i < n; i++) ret += x[i] * y[i];
+  return ret;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(float a, const float* x, float* y, size_t n)
+{
+  __m256 va = _mm256_set1_ps(a);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_store_ps(y + i, _mm256_fmadd_ps(va, _mm256_load_ps(x + i),
+                                            _mm256_load_ps(y + i)));
+  }
+  for (; i < n; i++) y[i] += a * x[i];
+}
+
+__attribute__((target("avx512f")))
+static float dot_avx512(const float* x, const float* y, size_t n)
+{
+  __m512 acc = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm512_fmadd_ps(_mm512_load_ps(x + i), _mm512_load_ps(y + i), acc);
+  }
+  if (i < n) {
+    // the remaining lanes, masked so nothing past n is read
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    acc = _mm512_fmadd_ps(_mm512_maskz_load_ps(m, x + i),
+                          _mm512_maskz_load_ps(m, y + i), acc);
+  }
+  // _mm512_reduce_add_ps() trips -Wuninitialized in some GCC headers
+  float lanes[16];
+  _mm512_storeu_ps(lanes, acc);
+  float ret = 0.0f;
+  for (size_t j = 0; j < 16; j++) ret += lanes[j];
+  return ret;
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(float a, const float* x, float* y, size_t n)
+{
+  __m512 va = _mm512_set1_ps(a);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_store_ps(y + i, _mm512_fmadd_ps(va, _mm512_load_ps(x + i),
+                                            _mm512_load_ps(y + i)));
+  }
+  if (i < n) {
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    __m512 vy = _mm512_maskz_load_ps(m, y + i);
+    _mm512_mask_store_ps(y + i, m,
+                          _mm512_fmadd_ps(va, _mm512_maskz_load_ps(m, x + i), vy));
+  }
+}
+
+#endif
+
+std::vector<VectorKernels> available_vector_kernels()
+{
+  std::vector<VectorKernels> ret;
+  ret.push_back({"portable", dot_portable, axpy_portable});
+#ifdef SELECTOR_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    ret.push_back({"sse2", dot_sse, axpy_sse});
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    ret.push_back({"avx2", dot_avx2, axpy_avx2});
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    ret.push_back({"avx512", dot_avx512, axpy_avx512});
+  }
+#endif
+  return ret;
+}
+
+const VectorKernels& vector_kernels()
+{
+  static const VectorKernels best = available_vector_kernels().back();
+  return best;
+}
+
+FloatMatrix::~FloatMatrix()
+{
+  free(data);
+}
+
+void FloatMatrix::resize(size_t rows, size_t cols)
+{
+  free(data);
+  data = nullptr;
+  n_rows = rows;
+  n_cols = cols;
+  // 16 floats = 64 bytes
+  stride = (cols + 15) / 16 * 16;
+  size_t bytes = rows * stride * sizeof(float);
+  if (bytes == 0) return;
+  void* p = nullptr;
+  if (posix_memalign(&p, 64, bytes) != 0) throw std::bad_alloc();
+  data = (float*)p;
+  memset(data, 0, bytes);
+}
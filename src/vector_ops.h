@@ -0,0 +1,44 @@
+#ifndef __SELECTOR_VECTOR_OPS_H__
+#define __SELECTOR_VECTOR_OPS_H__
+
+#include <cstddef>
+#include <vector>
+
+// dot product of x and y, and y += a * x, over n floats
+// x and y must start on 64-byte boundaries, like FloatMatrix rows
+typedef float (*DotKernel)(const float* x, const float* y, size_t n);
+typedef void (*AxpyKernel)(float a, const float* x, float* y, size_t n);
+
+struct VectorKernels {
+  const char* name;
+  DotKernel dot;
+  AxpyKernel axpy;
+};
+
+// the kernels for the widest instruction set this CPU supports,
+// chosen on first use
+const VectorKernels& vector_kernels();
+// every set of kernels this CPU can run, the portable one first
+std::vector<VectorKernels> available_vector_kernels();
+
+// a matrix of floats whose rows each start on a 64-byte boundary
+class FloatMatrix {
+private:
+  float* data = nullptr;
+  size_t n_rows = 0;
+  size_t n_cols = 0;
+  size_t stride = 0;
+public:
+  FloatMatrix() {}
+  ~FloatMatrix();
+  FloatMatrix(const FloatMatrix&) = delete;
+  FloatMatrix& operator=(const FloatMatrix&) = delete;
+  // discard the contents and make a zeroed rows x cols matrix
+  void resize(size_t rows, size_t cols);
+  float* row(size_t i) { return data + i * stride; }
+  const float* row(size_t i) const { return data + i * stride; }
+  size_t rows() const { return n_rows; }
+  size_t cols() const { return n_cols; }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "weight_table.h"
+#include <lttoolbox/endian_util.h>
+#include <algorithm>
+#include <cstring>
+
+uint64_t WeightTable::pack(const FeatLoc& fl)
+{
+  return ((uint64_t)(uint16_t)fl.first << 48) | (fl.second & 0xFFFFFFFFFFFFull);
+}
+
+FeatLoc WeightTable::unpack(uint64_t k)
+{
+  return std::make_pair((int)(int16_t)(uint16_t)(k >> 48),
+                        k & 0xFFFFFFFFFFFFull);
+}
+
+size_t WeightTable::hash(uint64_t k1, uint64_t k2)
+{
+  uint64_t h = k1 * 0x9E3779B97F4A7C15ull;
+  h ^= k2 + 0x7F4A7C159E3779B9ull + (h << 6) + (h >> 2);
+  h ^= h >> 31;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 29;
+  return (size_t)h;
+}
+
+size_t WeightTable::probe(uint64_t k1, uint64_t k2) const
+{
+  size_t mask = ent_len - 1;
+  size_t i = hash(k1, k2) & mask;
+  while (ent[i].key1 != EMPTY &&
+         (ent[i].key1 != k1 || ent[i].key2 != k2)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void WeightTable::own()
+{
+  if (ent != entries.data()) {
+    entries.assign(ent, ent + ent_len);
+  }
+  if (hd != heads.data()) {
+    heads.assign(hd, hd + hd_len);
+  }
+  sync();
+}
+
+void WeightTable::sync()
+{
+  ent = entries.data();
+  ent_len = entries.size();
+  hd = heads.data();
+  hd_len = heads.size();
+}
+
+void WeightTable::grow()
+{
+  std::vector<Entry> old;
+  old.swap(entries);
+  entries.resize(old.empty() ? 16 : old.size() * 2,
+                 Entry{EMPTY, EMPTY, 0.0});
+  sync();
+  for (auto& e : old) {
+    if (e.key1 == EMPTY) continue;
+    entries[probe(e.key1, e.key2)] = e;
+  }
+}
+
+void WeightTable::grow_heads()
+{
+  std::vector<uint64_t> old;
+  old.swap(heads);
+  heads.resize(old.empty() ? 16 : old.size() * 2, EMPTY);
+  sync();
+  size_t mask = heads.size() - 1;
+  for (auto& k : old) {
+    if (k == EMPTY) continue;
+    size_t i = hash(k, 0) & mask;
+    while (heads[i] != EMPTY) i = (i + 1) & mask;
+    heads[i] = k;
+  }
+}
+
+void WeightTable::add_head(uint64_t k)
+{
+  if ((head_count + 1) * 2 > heads.size()) grow_heads();
+  size_t mask = heads.size() - 1;
+  size_t i = hash(k, 0) & mask;
+  while (heads[i] != EMPTY) {
+    if (heads[i] == k) return;
+    i = (i + 1) & mask;
+  }
+  heads[i] = k;
+  head_count++;
+}
+
+void WeightTable::clear()
+{
+  entries.clear();
+  heads.clear();
+  count = 0;
+  head_count = 0;
+  sync();
+}
+
+bool WeightTable::insert(const FeatLoc& a, const FeatLoc& b, double w)
+{
+  own();
+  if ((count + 1) * 2 > entries.size()) grow();
+  uint64_t k1 = pack(a);
+  uint64_t k2 = pack(b);
+  size_t i = probe(k1, k2);
+  if (entries[i].key1 != EMPTY) return false;
+  entries[i] = Entry{k1, k2, w};
+  count++;
+  add_head(k1);
+  return true;
+}
+
+void WeightTable::set(const FeatLoc& a, const FeatLoc& b, double w)
+{
+  if (!insert(a, b, w)) {
+    entries[probe(pack(a), pack(b))].weight = w;
+  }
+}
+
+const double* WeightTable::find(const FeatLoc& a, const FeatLoc& b) const
+{
+  if (ent_len == 0) return nullptr;
+  const Entry& e = ent[probe(pack(a), pack(b))];
+  return (e.key1 == EMPTY ? nullptr : &e.weight);
+}
+
+bool WeightTable::has_first(const FeatLoc& a) const
+{
+  if (hd_len == 0) return false;
+  uint64_t k = pack(a);
+  size_t mask = hd_len - 1;
+  size_t i = hash(k, 0) & mask;
+  while (hd[i] != EMPTY) {
+    if (hd[i] == k) return true;
+    i = (i + 1) & mask;
+  }
+  return false;
+}
+
+std::vector<std::pair<FeatPair, double>> WeightTable::sorted() const
+{
+  std::vector<std::pair<FeatPair, double>> ret;
+  ret.reserve(count);
+  for (size_t i = 0; i < ent_len; i++) {
+    auto& e = ent[i];
+    if (e.key1 == EMPTY) continue;
+    ret.push_back(std::make_pair(std::make_pair(unpack(e.key1), unpack(e.key2)),
+                                 e.weight));
+  }
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
+void WeightTable::write_flat(FILE* output) const
+{
+  write_le<uint64_t>(output, count);
+  write_le<uint64_t>(output, head_count);
+  write_le<uint64_t>(output, ent_len);
+  write_le<uint64_t>(output, hd_len);
+  for (size_t i = 0; i < ent_len; i++) {
+    write_le<uint64_t>(output, ent[i].key1);
+    write_le<uint64_t>(output, ent[i].key2);
+    uint64_t bits;
+    memcpy(&bits, &ent[i].weight, sizeof(bits));
+    write_le<uint64_t>(output, bits);
+  }
+  for (size_t i = 0; i < hd_len; i++) {
+    write_le<uint64_t>(output, hd[i]);
+  }
+}
+
+size_t WeightTable::view_flat(const char* data, size_t len)
+{
+  static_assert(sizeof(Entry) == 24, "WeightTable::Entry must be packed");
+  if (len < 4*sizeof(uint64_t)) return 0;
+  const uint64_t* sizes = reinterpret_cast<const uint64_t*>(data);
+  size_t used = 4*sizeof(uint64_t);
+  size_t n_ent = sizes[2];
+  size_t n_hd = sizes[3];
+  // table sizes are powers of 2 (or 0)
+  if ((n_ent & (n_ent - 1)) || (n_hd & (n_hd - 1))) return 0;
+  // probing only stops at an empty slot, so a full table would make
+  // lookups of missing keys loop forever
+  if (n_ent ? sizes[0] >= n_ent : sizes[0] != 0) return 0;
+  if (n_hd ? sizes[1] >= n_hd : sizes[1] != 0) return 0;
+  if (n_ent > (len - used) / sizeof(Entry)) return 0;
+  if (n_hd > (len - used - n_ent*sizeof(Entry)) / sizeof(uint64_t)) return 0;
+  entries.clear();
+  heads.clear();
+  count = sizes[0];
+  head_count = sizes[1];
+  ent = reinterpret_cast<const Entry*>(data + used);
+  ent_len = n_ent;
+  used += n_ent*sizeof(Entry);
+  hd = reinterpret_cast<const uint64_t*>(data + used);
+  hd_len = n_hd;
+  used += n_hd*sizeof(uint64_t);
+  return used;
+}
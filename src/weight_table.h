@@ -0,0 +1,64 @@
+#ifndef __SELECTOR_WEIGHT_TABLE_H__
+#define __SELECTOR_WEIGHT_TABLE_H__
+
+#include "lu.h"
+
+// flat open-addressing hash table from an ordered pair of FeatLocs to
+// a weight
+// each FeatLoc is packed into 64 bits (16 bits position, 48 bits feature)
+// so that a probe only ever touches one 24-byte entry
+class WeightTable {
+public:
+  struct Entry {
+    uint64_t key1;
+    uint64_t key2;
+    double weight;
+  };
+  static constexpr uint64_t EMPTY = ~0ull;
+private:
+  std::vector<Entry> entries;
+  // packed FeatLocs that occur as the first element of some pair,
+  // so that get_weight() can skip most rows with a single probe
+  std::vector<uint64_t> heads;
+  size_t count = 0;
+  size_t head_count = 0;
+  // what lookups actually read: either the vectors above or
+  // arrays in a memory-mapped file (see view_flat())
+  const Entry* ent = nullptr;
+  size_t ent_len = 0;
+  const uint64_t* hd = nullptr;
+  size_t hd_len = 0;
+
+  static size_t hash(uint64_t k1, uint64_t k2);
+  size_t probe(uint64_t k1, uint64_t k2) const;
+  void grow();
+  void grow_heads();
+  void add_head(uint64_t k);
+  void own();
+  void sync();
+public:
+  static uint64_t pack(const FeatLoc& fl);
+  static FeatLoc unpack(uint64_t k);
+
+  void clear();
+  // insert a => b if not already present, return false if present
+  // a should be less than b
+  bool insert(const FeatLoc& a, const FeatLoc& b, double w);
+  // insert or overwrite a => b
+  void set(const FeatLoc& a, const FeatLoc& b, double w);
+  // return nullptr if a => b is not present
+  const double* find(const FeatLoc& a, const FeatLoc& b) const;
+  bool has_first(const FeatLoc& a) const;
+  size_t size() const { return count; }
+  // all pairs, ordered as they would be in a nested std::map
+  std::vector<std::pair<FeatPair, double>> sorted() const;
+  // write the table as fixed-width little-endian arrays
+  void write_flat(FILE* output) const;
+  // use arrays written by write_flat() in place without copying
+  // return the number of bytes used, or 0 if data is malformed
+  // data must be 8-byte aligned and outlive the table (or the next
+  // modification, which copies it)
+  size_t view_flat(const char* data, size_t len);
+};
+
+#endif